@@ -15,6 +15,14 @@
 #define MALLOC(sz) bf_malloc(sz)
 #define FREE(p)    bf_free(p)
 #endif
+#ifdef NF
+#define MALLOC(sz) nf_malloc(sz)
+#define FREE(p)    nf_free(p)
+#endif
+#ifdef GF
+#define MALLOC(sz) gf_malloc(sz)
+#define FREE(p)    gf_free(p)
+#endif
 
 
 double calc_time(struct timespec start, struct timespec end) {
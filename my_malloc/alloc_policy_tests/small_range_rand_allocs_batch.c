@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "my_malloc.h"
+
+#define NUM_ITERS 100
+#define NUM_ITEMS 10000
+
+#ifdef FF
+#define MALLOC(sz) ff_malloc(sz)
+#define FREE(p) ff_free(p)
+#define MALLOC_BATCH(sz, n, out) ff_malloc_batch(sz, n, out)
+#define FREE_BATCH(ptrs, n) ff_free_batch(ptrs, n)
+#endif
+#ifdef BF
+#define MALLOC(sz) bf_malloc(sz)
+#define FREE(p) bf_free(p)
+#define MALLOC_BATCH(sz, n, out) bf_malloc_batch(sz, n, out)
+#define FREE_BATCH(ptrs, n) bf_free_batch(ptrs, n)
+#endif
+#ifdef NF
+#define MALLOC(sz) nf_malloc(sz)
+#define FREE(p) nf_free(p)
+#define MALLOC_BATCH(sz, n, out) nf_malloc_batch(sz, n, out)
+#define FREE_BATCH(ptrs, n) nf_free_batch(ptrs, n)
+#endif
+#ifdef GF
+#define MALLOC(sz) gf_malloc(sz)
+#define FREE(p) gf_free(p)
+#define MALLOC_BATCH(sz, n, out) gf_malloc_batch(sz, n, out)
+#define FREE_BATCH(ptrs, n) gf_free_batch(ptrs, n)
+#endif
+
+/*
+The same workload as small_range_rand_allocs, but every group of 50
+frees is one FREE_BATCH, and every group of 50 mallocs is one
+MALLOC_BATCH per distinct size in the group (there are at most 13),
+so the blocks and their sizes are exactly those of the plain test.
+The items of every group are sorted by size before the timer starts.
+*/
+#define BATCH 50
+
+double calc_time(struct timespec start, struct timespec end) {
+  double start_sec = (double)start.tv_sec * 1000000000.0 + (double)start.tv_nsec;
+  double end_sec = (double)end.tv_sec * 1000000000.0 + (double)end.tv_nsec;
+
+  if (end_sec < start_sec) {
+    return 0;
+  }
+  else {
+    return end_sec - start_sec;
+  }
+};
+
+struct malloc_list {
+  size_t bytes;
+  int * address;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[2][NUM_ITEMS];
+
+unsigned free_list[NUM_ITEMS];
+
+void * batch[BATCH];
+
+//the items of each group of BATCH, ordered by size
+unsigned by_size[2][NUM_ITEMS];
+
+int main(int argc, char * argv[]) {
+  int i, j, k;
+  unsigned tmp;
+  unsigned long data_segment_size;
+  unsigned long data_segment_free_space;
+  struct timespec start_time, end_time;
+
+  srand(0);
+
+  const unsigned chunk_size = 32;
+  const unsigned min_chunks = 4;
+  const unsigned max_chunks = 16;
+  for (i = 0; i < NUM_ITEMS; i++) {
+    malloc_items[0][i].bytes =
+        ((rand() % (max_chunks - min_chunks + 1)) + min_chunks) * chunk_size;
+    malloc_items[1][i].bytes =
+        ((rand() % (max_chunks - min_chunks + 1)) + min_chunks) * chunk_size;
+    free_list[i] = i;
+  }  //for i
+
+  i = NUM_ITEMS;
+  while (i > 1) {
+    i--;
+    j = rand() % i;
+    tmp = free_list[i];
+    free_list[i] = free_list[j];
+    free_list[j] = tmp;
+  }  //while
+
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < NUM_ITEMS; j++) {
+      //insertion sort inside the group of j
+      unsigned item = j;
+      for (k = j; k % BATCH != 0 &&
+                  malloc_items[i][by_size[i][k - 1]].bytes > malloc_items[i][item].bytes;
+           k--) {
+        by_size[i][k] = by_size[i][k - 1];
+      }
+      by_size[i][k] = item;
+    }  //for j
+  }    //for i
+
+  for (i = 0; i < NUM_ITEMS; i++) {
+    malloc_items[0][i].address = (int *)MALLOC(malloc_items[0][i].bytes);
+  }  //for i
+
+  //Start Time
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  for (i = 0; i < NUM_ITERS; i++) {
+    unsigned malloc_set = i % 2;
+    for (j = 0; j < NUM_ITEMS; j += BATCH) {
+      for (k = 0; k < BATCH; k++) {
+        unsigned item_to_free = free_list[j + k];
+        batch[k] = malloc_items[malloc_set][item_to_free].address;
+      }  //for k
+      FREE_BATCH(batch, BATCH);
+      unsigned * order = &by_size[1 - malloc_set][j];
+      for (k = 0; k < BATCH;) {
+        //the run of items with the same size is one batch
+        size_t bytes = malloc_items[1 - malloc_set][order[k]].bytes;
+        int count = 1;
+        while (k + count < BATCH && malloc_items[1 - malloc_set][order[k + count]].bytes == bytes) {
+          count++;
+        }
+        MALLOC_BATCH(bytes, count, batch);
+        for (int m = 0; m < count; m++) {
+          malloc_items[1 - malloc_set][order[k + m]].address = (int *)batch[m];
+        }  //for m
+        k += count;
+      }  //for k
+    }    //for j
+  }      //for i
+
+  //Stop Time
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+  data_segment_size = get_data_segment_size();
+  data_segment_free_space = get_data_segment_free_space_size();
+  printf("data_segment_size = %lu, data_segment_free_space = %lu\n",
+         data_segment_size,
+         data_segment_free_space);
+
+  double elapsed_ns = calc_time(start_time, end_time);
+  printf("Execution Time = %f seconds\n", elapsed_ns / 1e9);
+  printf("Fragmentation  = %f\n",
+         (float)data_segment_free_space / (float)data_segment_size);
+
+  for (i = 0; i < NUM_ITEMS; i++) {
+    FREE(malloc_items[0][i].address);
+  }  //for i
+
+  return 0;
+}
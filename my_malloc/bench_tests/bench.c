@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "my_malloc.h"
+
+/*
+One run of one workload on one allocator configuration: the policy is
+-DFF/BF/NF/GF and the variant is the build flag of the allocator that is
+compiled in (-DSEGREGATED, -DSLAB, -DDEFERRED, or none).
+The workloads are those of alloc_policy_tests, sized to run for a
+fraction of a second so that bench_run can repeat them.
+*/
+
+#define NUM_ITEMS 10000
+
+#ifdef FF
+#define POLICY "FF"
+#define MALLOC(sz) ff_malloc(sz)
+#define FREE(p) ff_free(p)
+#endif
+#ifdef BF
+#define POLICY "BF"
+#define MALLOC(sz) bf_malloc(sz)
+#define FREE(p) bf_free(p)
+#endif
+#ifdef NF
+#define POLICY "NF"
+#define MALLOC(sz) nf_malloc(sz)
+#define FREE(p) nf_free(p)
+#endif
+#ifdef GF
+#define POLICY "GF"
+#define MALLOC(sz) gf_malloc(sz)
+#define FREE(p) gf_free(p)
+#endif
+
+#if defined(SEGREGATED)
+#define VARIANT "SEGREGATED"
+#elif defined(SLAB)
+#define VARIANT "SLAB"
+#elif defined(DEFERRED)
+#define VARIANT "DEFERRED"
+#else
+#define VARIANT "DEFAULT"
+#endif
+
+double calc_time(struct timespec start, struct timespec end) {
+  double start_sec = (double)start.tv_sec * 1000000000.0 + (double)start.tv_nsec;
+  double end_sec = (double)end.tv_sec * 1000000000.0 + (double)end.tv_nsec;
+
+  if (end_sec < start_sec) {
+    return 0;
+  }
+  else {
+    return end_sec - start_sec;
+  }
+};
+
+//what the samples of the heap have seen so far
+unsigned long mallocs = 0;
+unsigned long samples = 0;
+unsigned long peak_heap = 0;
+double frag_sum = 0;
+double frag_max = 0;
+//time spent sampling, taken out of the result
+double sample_ns = 0;
+//the timed part of the workload, and the heap at its end
+struct timespec start_time;
+double elapsed_ns = 0;
+double frag_end = 0;
+
+//Return free space / heap size, and the heap size in *heap
+double fragmentation(unsigned long * heap) {
+  unsigned long data_segment_size = get_data_segment_size();
+  *heap = data_segment_size + get_mmapped_size();
+  if (data_segment_size == 0) {
+    return 0;
+  }
+  return (double)get_data_segment_free_space_size() / (double)data_segment_size;
+}
+
+//Sample the heap on every BENCH_SAMPLE_OPS mallocs
+void sample() {
+  if (++mallocs % BENCH_SAMPLE_OPS != 0) {
+    return;
+  }
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  unsigned long heap;
+  double frag = fragmentation(&heap);
+  samples++;
+  frag_sum += frag;
+  if (frag > frag_max) {
+    frag_max = frag;
+  }
+  if (heap > peak_heap) {
+    peak_heap = heap;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  sample_ns += calc_time(t0, t1);
+}
+
+void * bench_malloc(size_t size) {
+  void * p = MALLOC(size);
+  sample();
+  return p;
+}
+
+//Start the clock once the workload is set up
+void bench_start() {
+  sample_ns = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+//Stop the clock and measure the heap, before the workload frees everything
+void bench_stop() {
+  struct timespec end_time;
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  elapsed_ns = calc_time(start_time, end_time) - sample_ns;
+  unsigned long heap;
+  frag_end = fragmentation(&heap);
+  if (heap > peak_heap) {
+    peak_heap = heap;
+  }
+}
+
+/*
+equal_size_allocs: 128 byte blocks streamed through a window of 1000
+live blocks, with a used block between every two freed ones
+*/
+void equal_size() {
+  static int * array[NUM_ITEMS];
+  static int * spacing_array[NUM_ITEMS];
+  const int num_iters = 50;
+
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    array[i] = bench_malloc(128);
+    spacing_array[i] = bench_malloc(128);
+  }
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    FREE(array[i]);
+  }
+
+  bench_start();
+  for (int i = 0; i < num_iters; i++) {
+    for (int j = 0; j < 1000; j++) {
+      array[j] = bench_malloc(128);
+    }
+    for (int j = 1000; j < NUM_ITEMS; j++) {
+      array[j] = bench_malloc(128);
+      FREE(array[j - 1000]);
+    }
+    for (int j = NUM_ITEMS - 1000; j < NUM_ITEMS; j++) {
+      FREE(array[j]);
+    }
+  }
+  bench_stop();
+
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    FREE(spacing_array[i]);
+  }
+}
+
+/*
+small_range_rand_allocs and large_range_rand_allocs: NUM_ITEMS blocks of
+min_chunks - max_chunks chunks of 32 bytes, then num_iters times free a
+random 50 of them and malloc 50 new ones
+*/
+void range(unsigned min_chunks, unsigned max_chunks, int num_iters) {
+  static size_t bytes[2][NUM_ITEMS];
+  static int * address[2][NUM_ITEMS];
+  static unsigned free_list[NUM_ITEMS];
+  const unsigned chunk_size = 32;
+
+  srand(0);
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    bytes[0][i] = ((rand() % (max_chunks - min_chunks + 1)) + min_chunks) * chunk_size;
+    bytes[1][i] = ((rand() % (max_chunks - min_chunks + 1)) + min_chunks) * chunk_size;
+    free_list[i] = i;
+  }
+  for (int i = NUM_ITEMS - 1; i > 0; i--) {
+    int j = rand() % i;
+    unsigned tmp = free_list[i];
+    free_list[i] = free_list[j];
+    free_list[j] = tmp;
+  }
+
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    address[0][i] = bench_malloc(bytes[0][i]);
+  }
+
+  bench_start();
+  for (int i = 0; i < num_iters; i++) {
+    unsigned malloc_set = i % 2;
+    for (int j = 0; j < NUM_ITEMS; j += 50) {
+      for (int k = 0; k < 50; k++) {
+        FREE(address[malloc_set][free_list[j + k]]);
+        address[malloc_set][free_list[j + k]] = NULL;
+      }
+      for (int k = 0; k < 50; k++) {
+        address[1 - malloc_set][j + k] = bench_malloc(bytes[1 - malloc_set][j + k]);
+      }
+    }
+  }
+  bench_stop();
+
+  //the set that was malloc'ed last holds every live block
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    FREE(address[num_iters % 2][i]);
+  }
+}
+
+int main(int argc, char * argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s workload\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(argv[1], "equal_size") == 0) {
+    equal_size();
+  }
+  else if (strcmp(argv[1], "small_range") == 0) {
+    range(4, 16, 50);
+  }
+  else if (strcmp(argv[1], "large_range") == 0) {
+    range(1, 2048, 10);
+  }
+  else {
+    fprintf(stderr, "%s: unknown workload %s\n", argv[0], argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  printf("%s %s %s %s %.0f %lu %f %f %f\n",
+         BENCH_RESULT,
+         POLICY,
+         VARIANT,
+         argv[1],
+         elapsed_ns,
+         peak_heap,
+         samples ? frag_sum / samples : frag_end,
+         frag_max,
+         frag_end);
+  return 0;
+}
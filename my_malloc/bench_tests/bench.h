@@ -0,0 +1,25 @@
+/*
+Shared by bench (one allocator configuration, one run of one workload)
+and bench_run (runs every configuration many times and sums them up).
+
+bench <workload> runs the workload once and prints a single line:
+
+    BENCH_RESULT policy variant workload time_ns peak_heap frag_mean frag_max frag_end
+
+time_ns leaves out the time spent sampling the heap. The heap is
+sampled every BENCH_SAMPLE_OPS mallocs: frag_mean and frag_max are the
+mean and the largest free space / heap size over those samples,
+frag_end is the same ratio after the last op, and peak_heap is the
+largest heap (data segment + mapped blocks) seen in a sample.
+*/
+#define BENCH_RESULT "BENCH_RESULT"
+
+#define BENCH_SAMPLE_OPS 1000
+
+#define NUM_WORKLOADS 3
+
+static const char * const bench_workloads[NUM_WORKLOADS] = {
+    "equal_size",
+    "small_range",
+    "large_range",
+};
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/*
+Run every workload of every bench binary (one allocator configuration
+each) warmup + runs times, each run in a fresh process, and report the
+median time with a 95% confidence interval, the peak heap and the
+fragmentation sampled over the run.
+
+The runs are interleaved (round 1 of every configuration, then round 2,
+...) so that a slow patch of the machine is spread over all of them
+instead of hitting one. The warmup rounds are thrown away.
+
+usage: bench_run [-n runs] [-w warmup] [-l label] [-c csv] [-j json]
+                 [-b baseline.csv] bench_binary...
+*/
+
+#define MAX_NAME 64
+
+typedef struct result_tag {
+  const char * binary;
+  const char * workload;
+  char policy[MAX_NAME];
+  char variant[MAX_NAME];
+  //one entry per counted run
+  double * time;
+  double * peak_heap;
+  double * frag_mean;
+  double * frag_max;
+  double * frag_end;
+  //filled in by summarize
+  double median;
+  double ci_low;
+  double ci_high;
+  double min;
+  double max;
+  int failed;
+} result_t;
+
+/*
+Run binary on workload once and add the numbers to r (at index run, or
+nowhere if run is -1), return 0 if the run failed
+*/
+int runOnce(result_t * r, int run) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execl(r->binary, r->binary, r->workload, (char *)NULL);
+    perror(r->binary);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  char out[4096];
+  size_t len = 0;
+  ssize_t n;
+  while ((n = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0) {
+    len += n;
+  }
+  out[len] = '\0';
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s %s: failed (status %d)\n", r->binary, r->workload, status);
+    return 0;
+  }
+
+  char * line = strstr(out, BENCH_RESULT);
+  char workload[MAX_NAME];
+  double time, peak_heap, frag_mean, frag_max, frag_end;
+  if (line == NULL ||
+      sscanf(line + strlen(BENCH_RESULT),
+             "%63s %63s %63s %lf %lf %lf %lf %lf",
+             r->policy,
+             r->variant,
+             workload,
+             &time,
+             &peak_heap,
+             &frag_mean,
+             &frag_max,
+             &frag_end) != 8) {
+    fprintf(stderr, "%s %s: no result\n", r->binary, r->workload);
+    return 0;
+  }
+  if (run >= 0) {
+    r->time[run] = time / 1e9;
+    r->peak_heap[run] = peak_heap;
+    r->frag_mean[run] = frag_mean;
+    r->frag_max[run] = frag_max;
+    r->frag_end[run] = frag_end;
+  }
+  return 1;
+}
+
+int cmp_double(const void * a, const void * b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+//Return the median of the n values (left in their order)
+double median(const double * values, int n) {
+  double sorted[n];
+  memcpy(sorted, values, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), cmp_double);
+  return (n % 2) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+/*
+Distribution free 95% confidence interval of the median: the median lies
+between the k-th smallest and the k-th largest of n runs unless at
+least n - k + 1 runs fall on one side of it, which has probability
+2 * P(Binomial(n, 1/2) < k). Return the largest such k (1 based) with a
+probability of at most 5%; with fewer than 6 runs there is none, and the
+interval is min - max.
+*/
+int ciRank(int n) {
+  double p = 1;
+  for (int i = 0; i < n; i++) {
+    p /= 2;
+  }
+  double cdf = 0;
+  double choose = 1;
+  int k = 1;
+  for (int i = 0; i < n; i++) {
+    //cdf is P(Binomial(n, 1/2) <= i)
+    cdf += choose * p;
+    if (2 * cdf > 0.05) {
+      break;
+    }
+    k = i + 1;
+    choose = choose * (n - i) / (i + 1);
+  }
+  return k;
+}
+
+//Fill in the median of the times of r and its confidence interval
+void summarize(result_t * r, int runs) {
+  double sorted[runs];
+  memcpy(sorted, r->time, runs * sizeof(double));
+  qsort(sorted, runs, sizeof(double), cmp_double);
+  int k = ciRank(runs);
+  r->median = median(r->time, runs);
+  r->ci_low = sorted[k - 1];
+  r->ci_high = sorted[runs - k];
+  r->min = sorted[0];
+  r->max = sorted[runs - 1];
+}
+
+void writeCsv(FILE * f, const char * label, result_t * results, int count, int runs) {
+  fprintf(f,
+          "label,policy,variant,workload,runs,time_median,time_ci_low,time_ci_high,"
+          "time_min,time_max,peak_heap,frag_mean,frag_max,frag_end\n");
+  for (int i = 0; i < count; i++) {
+    result_t * r = &results[i];
+    if (r->failed) {
+      continue;
+    }
+    fprintf(f,
+            "%s,%s,%s,%s,%d,%f,%f,%f,%f,%f,%.0f,%f,%f,%f\n",
+            label,
+            r->policy,
+            r->variant,
+            r->workload,
+            runs,
+            r->median,
+            r->ci_low,
+            r->ci_high,
+            r->min,
+            r->max,
+            median(r->peak_heap, runs),
+            median(r->frag_mean, runs),
+            median(r->frag_max, runs),
+            median(r->frag_end, runs));
+  }
+}
+
+void writeJson(FILE * f, const char * label, result_t * results, int count, int runs, int warmup) {
+  fprintf(f, "{\n  \"label\": \"%s\",\n  \"runs\": %d,\n  \"warmup\": %d,\n", label, runs, warmup);
+  fprintf(f, "  \"confidence\": 0.95,\n  \"results\": [");
+  int first = 1;
+  for (int i = 0; i < count; i++) {
+    result_t * r = &results[i];
+    if (r->failed) {
+      continue;
+    }
+    fprintf(f, "%s\n    {\"policy\": \"%s\", \"variant\": \"%s\", \"workload\": \"%s\",\n",
+            first ? "" : ",",
+            r->policy,
+            r->variant,
+            r->workload);
+    first = 0;
+    fprintf(f,
+            "     \"time\": {\"median\": %f, \"ci_low\": %f, \"ci_high\": %f, \"runs\": [",
+            r->median,
+            r->ci_low,
+            r->ci_high);
+    for (int j = 0; j < runs; j++) {
+      fprintf(f, "%s%f", j ? ", " : "", r->time[j]);
+    }
+    fprintf(f,
+            "]},\n     \"peak_heap\": %.0f, \"frag_mean\": %f, \"frag_max\": %f, \"frag_end\": %f}",
+            median(r->peak_heap, runs),
+            median(r->frag_mean, runs),
+            median(r->frag_max, runs),
+            median(r->frag_end, runs));
+  }
+  fprintf(f, "\n  ]\n}\n");
+}
+
+/*
+Compare with the csv of an earlier bench_run: a configuration is slower
+(or faster) only if the two confidence intervals do not overlap.
+Return the number of slower configurations
+*/
+int compare(const char * path, result_t * results, int count) {
+  FILE * f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  char line[1024];
+  int slower = 0;
+  printf("\nCompared with %s:\n", path);
+  //skip the header
+  if (fgets(line, sizeof(line), f) == NULL) {
+    fclose(f);
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char policy[MAX_NAME], variant[MAX_NAME], workload[MAX_NAME];
+    double old_median, old_low, old_high;
+    //label may be empty, so skip it by hand
+    char * rest = strchr(line, ',');
+    for (char * c = rest; c != NULL && *c != '\0'; c++) {
+      if (*c == ',') {
+        *c = ' ';
+      }
+    }
+    if (rest == NULL ||
+        sscanf(rest, "%63s %63s %63s %*d %lf %lf %lf", policy, variant, workload, &old_median, &old_low, &old_high) != 6) {
+      continue;
+    }
+    for (int i = 0; i < count; i++) {
+      result_t * r = &results[i];
+      if (r->failed || strcmp(r->policy, policy) || strcmp(r->variant, variant) || strcmp(r->workload, workload)) {
+        continue;
+      }
+      const char * verdict = "same";
+      if (r->ci_low > old_high) {
+        verdict = "SLOWER";
+        slower++;
+      }
+      else if (r->ci_high < old_low) {
+        verdict = "faster";
+      }
+      printf("%-3s %-10s %-12s %f -> %f seconds (%+.1f%%) %s\n",
+             policy,
+             variant,
+             workload,
+             old_median,
+             r->median,
+             (r->median - old_median) / old_median * 100,
+             verdict);
+    }
+  }
+  fclose(f);
+  return slower;
+}
+
+int main(int argc, char * argv[]) {
+  int runs = 10;
+  int warmup = 2;
+  const char * label = "";
+  const char * csv = NULL;
+  const char * json = NULL;
+  const char * baseline = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:w:l:c:j:b:")) != -1) {
+    switch (opt) {
+      case 'n':
+        runs = atoi(optarg);
+        break;
+      case 'w':
+        warmup = atoi(optarg);
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      case 'c':
+        csv = optarg;
+        break;
+      case 'j':
+        json = optarg;
+        break;
+      case 'b':
+        baseline = optarg;
+        break;
+      default:
+        optind = argc + 1;
+    }
+  }
+  if (optind >= argc || runs < 1 || warmup < 0) {
+    fprintf(stderr,
+            "usage: %s [-n runs] [-w warmup] [-l label] [-c csv] [-j json] [-b baseline.csv] bench_binary...\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int count = (argc - optind) * NUM_WORKLOADS;
+  result_t * results = calloc(count, sizeof(result_t));
+  for (int i = 0; i < count; i++) {
+    result_t * r = &results[i];
+    r->binary = argv[optind + i / NUM_WORKLOADS];
+    r->workload = bench_workloads[i % NUM_WORKLOADS];
+    r->time = calloc(runs, sizeof(double));
+    r->peak_heap = calloc(runs, sizeof(double));
+    r->frag_mean = calloc(runs, sizeof(double));
+    r->frag_max = calloc(runs, sizeof(double));
+    r->frag_end = calloc(runs, sizeof(double));
+  }
+
+  for (int round = 0; round < warmup + runs; round++) {
+    fprintf(stderr, "%s round %d of %d\n", round < warmup ? "warmup" : "timed", round + 1, warmup + runs);
+    for (int i = 0; i < count; i++) {
+      if (!results[i].failed && !runOnce(&results[i], round - warmup)) {
+        results[i].failed = 1;
+      }
+    }
+  }
+
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    result_t * r = &results[i];
+    if (r->failed) {
+      failed++;
+      continue;
+    }
+    summarize(r, runs);
+    printf("%-3s %-10s %-12s Execution Time = %f seconds [%f, %f], Fragmentation = %f (max %f)\n",
+           r->policy,
+           r->variant,
+           r->workload,
+           r->median,
+           r->ci_low,
+           r->ci_high,
+           median(r->frag_mean, runs),
+           median(r->frag_max, runs));
+  }
+
+  if (csv != NULL) {
+    FILE * f = fopen(csv, "w");
+    if (f == NULL) {
+      perror(csv);
+      return EXIT_FAILURE;
+    }
+    writeCsv(f, label, results, count, runs);
+    fclose(f);
+  }
+  if (json != NULL) {
+    FILE * f = fopen(json, "w");
+    if (f == NULL) {
+      perror(json);
+      return EXIT_FAILURE;
+    }
+    writeJson(f, label, results, count, runs, warmup);
+    fclose(f);
+  }
+
+  int slower = (baseline != NULL) ? compare(baseline, results, count) : 0;
+  return (failed || slower) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "my_malloc.h"
+
+#ifdef FF
+#define MALLOC(sz) ff_malloc(sz)
+#endif
+#ifdef BF
+#define MALLOC(sz) bf_malloc(sz)
+#endif
+#ifdef NF
+#define MALLOC(sz) nf_malloc(sz)
+#endif
+#ifdef GF
+#define MALLOC(sz) gf_malloc(sz)
+#endif
+
+/*
+A request that can never be served must return NULL, from the policy
+and from ts_malloc: a size near SIZE_MAX must not be rounded up (and
+wrap around) to a small block.
+*/
+
+size_t sizes[] = {SIZE_MAX, SIZE_MAX - 7, SIZE_MAX - 15, SIZE_MAX / 2, MAX_REQUEST + 1};
+
+int main(int argc, char * argv[]) {
+  int failed = 0;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    void * p = MALLOC(sizes[i]);
+    void * q = ts_malloc(sizes[i]);
+    if (p != NULL || q != NULL) {
+      printf("Size %zu: malloc = %p, ts_malloc = %p, not NULL\n", sizes[i], p, q);
+      failed = 1;
+    }
+  }
+
+  printf(failed ? "Test failed\n" : "Test passed\n");
+  return failed;
+}
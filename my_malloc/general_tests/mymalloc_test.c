@@ -11,6 +11,14 @@
 #define MALLOC(sz) bf_malloc(sz)
 #define FREE(p) bf_free(p)
 #endif
+#ifdef NF
+#define MALLOC(sz) nf_malloc(sz)
+#define FREE(p) nf_free(p)
+#endif
+#ifdef GF
+#define MALLOC(sz) gf_malloc(sz)
+#define FREE(p) gf_free(p)
+#endif
 
 int main(int argc, char * argv[]) {
   const unsigned NUM_ITEMS = 10;
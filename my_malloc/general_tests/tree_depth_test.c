@@ -0,0 +1,81 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "my_malloc.h"
+
+#ifdef FF
+#define MALLOC(sz) ff_malloc(sz)
+#define FREE(p) ff_free(p)
+#endif
+#ifdef BF
+#define MALLOC(sz) bf_malloc(sz)
+#define FREE(p) bf_free(p)
+#endif
+#ifdef NF
+#define MALLOC(sz) nf_malloc(sz)
+#define FREE(p) nf_free(p)
+#endif
+#ifdef GF
+#define MALLOC(sz) gf_malloc(sz)
+#define FREE(p) gf_free(p)
+#endif
+
+#define ALLOC_SIZE 128
+//the tree may be this many times log2(free nodes) deep at most
+#define MAX_DEPTH_FACTOR 3
+
+/*
+The best-fit tree is a treap: its depth must stay O(log n) however the
+free nodes lie. Evenly spaced free nodes of one size (every other block
+of a run freed, as in equal_size_allocs) are the worst case for a weak
+address hash, so the test makes 1000, 10000 and 100000 of them and
+checks the depth of the tree of the main arena.
+*/
+
+//Add up the depths of the nodes under n (at depth), and find the deepest
+void treeDepth(node_t * n, unsigned long depth, unsigned long * total, unsigned long * max, unsigned long * count) {
+  while (n != NULL) {
+    *total += depth;
+    (*count)++;
+    if (depth > *max) {
+      *max = depth;
+    }
+    treeDepth(FREE_LINK(n)->left, depth + 1, total, max, count);
+    n = FREE_LINK(n)->right;
+    depth++;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  int failed = 0;
+
+  for (unsigned long items = 1000; items <= 100000; items *= 10) {
+    void ** blocks = malloc(2 * items * sizeof(void *));
+    for (unsigned long i = 0; i < 2 * items; i++) {
+      blocks[i] = MALLOC(ALLOC_SIZE);
+    }
+    for (unsigned long i = 0; i < 2 * items; i += 2) {
+      FREE(blocks[i]);
+    }
+
+    unsigned long total = 0;
+    unsigned long max = 0;
+    unsigned long count = 0;
+    treeDepth(arenas[0].size_tree, 1, &total, &max, &count);
+    unsigned long limit = (unsigned long)(MAX_DEPTH_FACTOR * log2((double)count)) + 1;
+    printf("Free nodes = %lu, Average Depth = %.1f, Max Depth = %lu (limit %lu)\n",
+           count, count ? (double)total / count : 0, max, limit);
+    if (max > limit) {
+      failed = 1;
+    }
+
+    for (unsigned long i = 1; i < 2 * items; i += 2) {
+      FREE(blocks[i]);
+    }
+    free(blocks);
+  }
+
+  printf(failed ? "Test failed\n" : "Test passed\n");
+  return failed;
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "my_malloc.h"
+
+#ifdef FF
+#define MALLOC(sz) ff_malloc(sz)
+#define FREE(p) ff_free(p)
+#endif
+#ifdef BF
+#define MALLOC(sz) bf_malloc(sz)
+#define FREE(p) bf_free(p)
+#endif
+#ifdef NF
+#define MALLOC(sz) nf_malloc(sz)
+#define FREE(p) nf_free(p)
+#endif
+#ifdef GF
+#define MALLOC(sz) gf_malloc(sz)
+#define FREE(p) gf_free(p)
+#endif
+
+#define NUM_PAIRS 1000
+//bigger than HEAP_CHUNK, smaller than the mmap threshold
+#define ALLOC_SIZE 100000
+
+/*
+A block a bit bigger than one heap chunk, malloc'ed and freed over and
+over, must not make the heap grow on every malloc and shrink on every
+free, also when the heap starts with a trimmed free tail: after the
+first pair, the heap size must stay the same.
+*/
+
+int main(int argc, char * argv[]) {
+  //two blocks first, so their frees trim the heap to a free tail
+  void * a = MALLOC(ALLOC_SIZE);
+  void * b = MALLOC(ALLOC_SIZE);
+  FREE(b);
+  FREE(a);
+  FREE(MALLOC(ALLOC_SIZE));
+
+  int changes = 0;
+  unsigned long heap = get_data_segment_size();
+  for (int i = 0; i < NUM_PAIRS; i++) {
+    void * p = MALLOC(ALLOC_SIZE);
+    if (get_data_segment_size() != heap) {
+      changes++;
+      heap = get_data_segment_size();
+    }
+    FREE(p);
+    if (get_data_segment_size() != heap) {
+      changes++;
+      heap = get_data_segment_size();
+    }
+  }
+
+  printf("Pairs = %d, Heap Size Changes = %d\n", NUM_PAIRS, changes);
+  printf(changes == 0 ? "Test passed\n" : "Test failed\n");
+  return changes != 0;
+}
@@ -8,313 +8,1774 @@ status of heap memo
 */
 
 //global variables
-node_t * head = NULL;
-node_t * tail = NULL;
-unsigned long heap_size = 0;
-unsigned long free_space = 0;
+//arenas[0] is the main arena, it grows with sbrk. The other arenas are
+//created by the thread safe allocator and grow inside their own mapping
+arena_t arenas[MAX_ARENAS] = {[0] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+int num_arenas = 1;
+//serializes the creation of new arenas
+pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* 
+//requests of at least this many bytes get their own mapping
+size_t mmap_threshold = MMAP_THRESHOLD;
+//a free tail of at least this many bytes is given back to the OS
+size_t trim_threshold = TRIM_THRESHOLD;
+//the heap grows by at least this many bytes
+size_t heap_chunk = HEAP_CHUNK;
+//the quick lists of an arena are merged when they hold more than this
+size_t quick_threshold = QUICK_THRESHOLD;
+//good fit takes a node that wastes at most this percent of the request
+size_t good_fit_slack = GOOD_FIT_SLACK;
+//and visits at most this many free nodes
+size_t good_fit_candidates = GOOD_FIT_CANDIDATES;
+//large blocks that are mapped right now, updated atomically
+unsigned long mmapped_size = 0;
+unsigned long mmapped_count = 0;
+
+/*
 This function will implement the malloc function with the first fit policy
 When finding the available space, we return the one that we first match.
 */
 void * ff_malloc(size_t size) {
-  //1. check if empty (check whether the Linked List is null)
-  if (head == NULL) {
-    //intially set the head and tail of the linked list
+  return policyMalloc(size, first_fit);
+}
+
+void ff_free(void * ptr) {
+  policyFree(ptr);
+}
+
+void * bf_malloc(size_t size) {
+  return policyMalloc(size, best_fit);
+}
+
+void bf_free(void * ptr) {
+  policyFree(ptr);
+}
+
+/*
+malloc with the next fit policy: the search goes on from the node the
+last search stopped at, so the small leftovers at the front of the free
+list are not stepped over again and again
+*/
+void * nf_malloc(size_t size) {
+  return policyMalloc(size, next_fit);
+}
 
-    return initLL(size);
+void nf_free(void * ptr) {
+  policyFree(ptr);
+}
+
+/*
+malloc with the good fit policy: a bounded search that is nearly as
+tight as best fit, see good_fit
+*/
+void * gf_malloc(size_t size) {
+  return policyMalloc(size, good_fit);
+}
+
+void gf_free(void * ptr) {
+  policyFree(ptr);
+}
+
+/*
+The body of ff/bf/nf/gf_malloc: the slab of size if there is one,
+otherwise arena_malloc on the main arena with fit (timed with -DSTATS)
+*/
+void * policyMalloc(size_t size, fit_t fit) {
+  STAT_START(start);
+  void * ptr = NULL;
+#ifdef SLAB
+  if (size <= SLAB_MAX_SIZE) {
+    ptr = slab_malloc(size);
   }
+#endif
+  if (ptr == NULL) {
+    ptr = arena_malloc(&arenas[0], size, fit);
+  }
+  STAT_LATENCY(malloc_ns, start);
+  return ptr;
+}
 
-  //2. search for the first fit
-  node_t * first = first_fit(size);
-  if (first != NULL) {
-    //split the first matched node
-    //and return the address of space that the user requested
-    return splitNode(first, size);
+/*
+The body of ff/bf/nf/gf_free: my_free on the main arena (timed with
+-DSTATS here, so the frees my_malloc does inside are not counted)
+*/
+void policyFree(void * ptr) {
+  STAT_START(start);
+  my_free(&arenas[0], ptr);
+  STAT_LATENCY(free_ns, start);
+}
+
+void * ff_realloc(void * ptr, size_t size) {
+  return arena_realloc(&arenas[0], ptr, size, first_fit);
+}
+
+void * bf_realloc(void * ptr, size_t size) {
+  return arena_realloc(&arenas[0], ptr, size, best_fit);
+}
+
+void * nf_realloc(void * ptr, size_t size) {
+  return arena_realloc(&arenas[0], ptr, size, next_fit);
+}
+
+void * gf_realloc(void * ptr, size_t size) {
+  return arena_realloc(&arenas[0], ptr, size, good_fit);
+}
+
+void ff_free_sized(void * ptr, size_t size) {
+  STAT_START(start);
+  sized_free(&arenas[0], ptr, size);
+  STAT_LATENCY(free_ns, start);
+}
+
+void bf_free_sized(void * ptr, size_t size) {
+  STAT_START(start);
+  sized_free(&arenas[0], ptr, size);
+  STAT_LATENCY(free_ns, start);
+}
+
+size_t ff_malloc_batch(size_t size, size_t count, void ** out) {
+  size_t done = 0;
+#ifdef SLAB
+  if (size <= SLAB_MAX_SIZE) {
+    while (done < count && (out[done] = slab_malloc(size)) != NULL) {
+      done++;
+    }
   }
+#endif
+  return done + arena_malloc_batch(&arenas[0], size, count - done, out + done, first_fit);
+}
 
-  //else first == NULL, which means there is no fit
-  //we have to increase the heap
-  void * address = incr_heap(size);
-  return address;
+size_t bf_malloc_batch(size_t size, size_t count, void ** out) {
+  size_t done = 0;
+#ifdef SLAB
+  if (size <= SLAB_MAX_SIZE) {
+    while (done < count && (out[done] = slab_malloc(size)) != NULL) {
+      done++;
+    }
+  }
+#endif
+  return done + arena_malloc_batch(&arenas[0], size, count - done, out + done, best_fit);
 }
 
-void ff_free(void * ptr) {
-  my_free(ptr);
+size_t nf_malloc_batch(size_t size, size_t count, void ** out) {
+  size_t done = 0;
+#ifdef SLAB
+  if (size <= SLAB_MAX_SIZE) {
+    while (done < count && (out[done] = slab_malloc(size)) != NULL) {
+      done++;
+    }
+  }
+#endif
+  return done + arena_malloc_batch(&arenas[0], size, count - done, out + done, next_fit);
 }
 
-void * bf_malloc(size_t size) {
-  //1. check if empty (check whether the Linked List is null)
-  if (head == NULL) {
-    //intially set the head and tail of the linked list
-    return initLL(size);
+size_t gf_malloc_batch(size_t size, size_t count, void ** out) {
+  size_t done = 0;
+#ifdef SLAB
+  if (size <= SLAB_MAX_SIZE) {
+    while (done < count && (out[done] = slab_malloc(size)) != NULL) {
+      done++;
+    }
+  }
+#endif
+  return done + arena_malloc_batch(&arenas[0], size, count - done, out + done, good_fit);
+}
+
+void ff_free_batch(void ** ptrs, size_t count) {
+  sortPointers(ptrs, count);
+  arena_free_batch(&arenas[0], ptrs, count);
+}
+
+void bf_free_batch(void ** ptrs, size_t count) {
+  sortPointers(ptrs, count);
+  arena_free_batch(&arenas[0], ptrs, count);
+}
+
+void nf_free_batch(void ** ptrs, size_t count) {
+  sortPointers(ptrs, count);
+  arena_free_batch(&arenas[0], ptrs, count);
+}
+
+void gf_free_batch(void ** ptrs, size_t count) {
+  sortPointers(ptrs, count);
+  arena_free_batch(&arenas[0], ptrs, count);
+}
+
+void * ff_memalign(size_t alignment, size_t size) {
+  return arena_memalign(&arenas[0], alignment, size, first_fit_aligned);
+}
+
+void * bf_memalign(size_t alignment, size_t size) {
+  return arena_memalign(&arenas[0], alignment, size, best_fit_aligned);
+}
+
+/*
+malloc on one arena with the given fit policy:
+search the free nodes of the arena with fit, split the node it finds,
+or increase the heap of the arena if there is no fit
+*/
+void * arena_malloc(arena_t * arena, size_t size, fit_t fit) {
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  size = adjust_size(size);
+
+  //a large request does not use the arena at all
+  if (size >= mmap_threshold) {
+    return mmap_malloc(size);
   }
 
-  //2. search for the best fit
-  node_t * best = best_fit(size);
-  if (best != NULL) {
-    //split the first matched node
+#ifdef DEFERRED
+  //a node of exactly this size may wait on a quick list
+  int cls = quick_class(size);
+  if (cls >= 0 && arena->quick[cls] != NULL) {
+    node_t * n = arena->quick[cls];
+    arena->quick[cls] = FREE_LINK(n)->next;
+    arena->quick_bytes -= n->size;
+    arena->quick_count--;
+    arena->free_space -= n->size;
+    arena->used_count++;
+    return (void *)((char *)n + NODE_SIZE);
+  }
+#endif
+
+  //1. search for a fit
+  node_t * found = fit(arena, size);
+#ifdef DEFERRED
+  if (found == NULL && arena->quick_bytes > 0) {
+    //a miss: merge the quick lists, then search again
+    arena_consolidate(arena);
+    found = fit(arena, size);
+  }
+#endif
+  if (found != NULL) {
+    //split the matched node
     //and return the address of space that the user requested
-    return splitNode(best, size);
+    return splitNode(arena, found, size);
   }
 
-  //else first == NULL, which means there is no fit
+  //else found == NULL, which means there is no fit
   //we have to increase the heap
-  void * address = incr_heap(size);
+  void * address = incr_heap(arena, size);
   return address;
 }
 
-/*                                                                          
-  this function will search through the LinkedList to 
-  search the best fit node                                                   
-                                                                            
-  rerturn:                                                                  
-  if there is: return the pointer to the node                               
-  else:  return NULL                                                        
-*/
-node_t * best_fit(size_t size) {
-  if (head == NULL) {
-    return NULL;
-  }
+/*
+  this function will search the best-fit tree for the smallest
+  free node that can fit the request (lowest address on a tie).
+  The tree is O(log n) deep, so is the search.
 
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
+*/
+node_t * best_fit(arena_t * arena, size_t size) {
+  STAT_ADD(searches, 1);
   node_t * best = NULL;
-  int difference = MAX_INT;
 
-  node_t * cur = head;
+  node_t * cur = arena->size_tree;
   while (cur != NULL) {
-    if (cur->used == 0 && cur->size == size) {
-      return cur;
-    }
-    else if (cur->used == 0 && cur->size > size && cur->size - size < difference) {
+    STAT_ADD(nodes_visited, 1);
+    if (cur->size >= size) {
+      //cur fits, but a smaller (or lower) node may be on the left
       best = cur;
-      difference = cur->size - size;
+      cur = FREE_LINK(cur)->left;
+    }
+    else {
+      //cur is too small, so is its whole left subtree
+      cur = FREE_LINK(cur)->right;
     }
-    cur = cur->next;
   }
 
   return best;
 }
 
-void bf_free(void * ptr) {
-  my_free(ptr);
+/*
+Return the aligned payload address that node n would give to a request
+of size bytes: the payload itself if it is aligned, otherwise the first
+aligned address that leaves room for a free node in front of it.
+return NULL if the request does not fit there
+*/
+char * alignedPayload(node_t * n, size_t alignment, size_t size) {
+  char * p = (char *)n + NODE_SIZE;
+  char * q = p;
+  if ((uintptr_t)p % alignment != 0) {
+    //the gap must be able to become a free node of its own
+    size_t min_gap = FOOTER_SIZE + NODE_SIZE + MIN_PAYLOAD;
+    q = (char *)(((uintptr_t)p + min_gap + alignment - 1) & ~(uintptr_t)(alignment - 1));
+  }
+  if (q + size > p + n->size) {
+    return NULL;
+  }
+  return q;
+}
+
+/*
+first fit for an aligned request: the first free node, in first_fit
+order, that has room at an aligned address
+*/
+node_t * first_fit_aligned(arena_t * arena, size_t alignment, size_t size) {
+  STAT_ADD(searches, 1);
+  //only bins that can hold size bytes, in the order first_fit uses
+  unsigned long map = arena->bin_map & (~0UL << get_bin(size));
+  while (map != 0) {
+    int bin = __builtin_ctzl(map);
+    map &= map - 1;
+    for (node_t * cur = arena->bins[bin]; cur != NULL; cur = FREE_LINK(cur)->next) {
+      STAT_ADD(nodes_visited, 1);
+      if (cur->size >= size && alignedPayload(cur, alignment, size) != NULL) {
+        return cur;
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+best fit for an aligned request: the smallest free node (lowest address
+on a tie) that has room at an aligned address. The tree is walked in
+order from the smallest node that is big enough.
+*/
+node_t * best_fit_aligned(arena_t * arena, size_t alignment, size_t size) {
+  STAT_ADD(searches, 1);
+  return treeFindAligned(arena->size_tree, alignment, size);
 }
 
-//This function will allocate new space to hold the node
-//return the pointer to the node
-node_t * makeSpaceForNode() {
-  //1. calling the sbrk to allocate sizeof(node_t) bytes
-  void * prev_brk = my_sbrk(sizeof(node_t));
+/*
+malloc on one arena where the payload address is a multiple of alignment
+(a power of two). fit looks for a free node that already has room at an
+aligned address, only a miss grows the heap with room to move up. The
+gap in front of the aligned payload and the rest after it are freed
+again, so nothing is wasted.
+*/
+void * arena_memalign(arena_t * arena, size_t alignment, size_t size, aligned_fit_t fit) {
+  if (size > MAX_REQUEST || alignment > MAX_REQUEST) {
+    return NULL;
+  }
+  if (alignment < ALIGNMENT) {
+    //every payload is aligned to ALIGNMENT anyway
+    alignment = ALIGNMENT;
+  }
+  size = adjust_size(size);
+
+  //the smallest gap that can be a node of its own
+  size_t min_gap = FOOTER_SIZE + NODE_SIZE + MIN_PAYLOAD;
+  size_t room = (alignment > ALIGNMENT) ? size + alignment + min_gap : size;
+  if (room >= mmap_threshold) {
+    return mmap_memalign(alignment, size);
+  }
+
+  //1. take a free node with room at an aligned address,
+  //or grow the heap by a node with room to move up
+  char * p;
+  node_t * n = fit(arena, alignment, size);
+#ifdef DEFERRED
+  if (n == NULL && arena->quick_bytes > 0) {
+    arena_consolidate(arena);
+    n = fit(arena, alignment, size);
+  }
+#endif
+  if (n != NULL) {
+    //the whole node is used for now, the step 2 and 3 give back the rest
+    p = splitNode(arena, n, n->size);
+  }
+  else {
+    p = incr_heap(arena, room);
+    if (p == NULL) {
+      return NULL;
+    }
+    n = (node_t *)(p - NODE_SIZE);
+  }
+
+  //2. move the payload up to the aligned address and free the gap
+  char * q = alignedPayload(n, alignment, size);
+  if (q != p) {
+    node_t * m = (node_t *)(q - NODE_SIZE);
+    size_t gap = (char *)m - (char *)n;
+
+    //m takes the rest of n, n keeps the gap
+    setNode(m, n->size - gap, 1);
+    setNode(n, gap - NODE_SIZE - FOOTER_SIZE, 1);
+    //the new tags are meta-data, which is counted as free space
+    arena->free_space += NODE_SIZE + FOOTER_SIZE;
+    arena->used_count++;
+    my_free(arena, p);
 
-  free_space += sizeof(node_t);  //node space is counted as free space
+    n = m;
+    p = q;
+  }
 
-  //2. return the pointer to the beginning of the node
-  return (node_t *)prev_brk;
+  //3. free what is left after the payload
+  shrinkNode(arena, n, size);
+  return p;
 }
 
-//this function is used when malloc is called for the first time
-//we init the Linked List as the current program break
-void * initLL(size_t size) {
-  //1. make space for the node
-  node_t * n = makeSpaceForNode();
+/*
+Shrink the used node n to size bytes of payload. If the rest is big
+enough to be a node, it is split off and freed (it may merge with the
+next node). Otherwise n keeps its size.
+*/
+void shrinkNode(arena_t * arena, node_t * n, size_t size) {
+  if (n->size - size < NODE_SIZE + MIN_PAYLOAD + FOOTER_SIZE) {
+    return;
+  }
 
-  //2. make space for the request
-  void * res = my_sbrk(size);
-  //3. set up the node
-  n->prev = NULL;
-  n->next = NULL;
-  n->size = size;
+  size_t rest = n->size - size - NODE_SIZE - FOOTER_SIZE;
+  setNode(n, size, 1);
+  node_t * m = nextNode(n);
+  setNode(m, rest, 1);
+  //the new tags are meta-data, which is counted as free space
+  arena->free_space += NODE_SIZE + FOOTER_SIZE;
+  arena->used_count++;
+  my_free(arena, (char *)m + NODE_SIZE);
+}
+
+/*
+realloc on one arena, in place whenever possible:
+1. shrink: split off the rest of the node and free it
+2. grow into the physical next node if it is free and big enough
+3. grow the last node of the heap by moving the break
+only if none of these works, allocate with fit, copy and free
+*/
+void * arena_realloc(arena_t * arena, void * ptr, size_t size, fit_t fit) {
+  if (ptr == NULL) {
+    return arena_malloc(arena, size, fit);
+  }
+  if (size == 0) {
+    my_free(arena, ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  size = adjust_size(size);
+#ifdef SLAB
+  slab_t * slab = slabOf(ptr);
+  if (slab != NULL) {
+    //a slot cannot grow, but it can stay if it is big enough
+    if (slab->size >= size) {
+      return ptr;
+    }
+    void * new_ptr = arena_malloc(arena, size, fit);
+    if (new_ptr != NULL) {
+      memcpy(new_ptr, ptr, slab->size);
+      slab_free(slab, ptr);
+    }
+    return new_ptr;
+  }
+#endif
+  node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
+
+  if (!n->mmapped) {
+    //1. the node is big enough, give the rest back
+    if (n->size >= size) {
+      shrinkNode(arena, n, size);
+      return ptr;
+    }
+
+    //2. take the free next node, if that is enough or if it is the tail
+    //(a free node is never next to a free node, so one look is enough)
+    node_t * next = nextNode(n);
+    int contiguous = my_sbrk(arena, 0) == arena->heap_end;
+    if (next->used == 0 &&
+        (n->size + NODE_SIZE + next->size + FOOTER_SIZE >= size ||
+         (contiguous && (char *)nextNode(next) + NODE_SIZE == arena->heap_end))) {
+      removeFreeNode(arena, next);
+      //the free node and its tags become payload of n
+      arena->free_space -= NODE_SIZE + next->size + FOOTER_SIZE;
+      setNode(n, n->size + NODE_SIZE + next->size + FOOTER_SIZE, 1);
+      next = nextNode(n);
+    }
+
+    //3. n is the last node of the heap: move the break and the epilogue
+    if (n->size < size && contiguous && (char *)next + NODE_SIZE == arena->heap_end) {
+      size_t increment = size - n->size;
+      if (my_sbrk(arena, increment) != (void *)-1) {
+        //the new bytes are payload, so the free space does not change
+        arena->heap_end += increment;
+        setNode(n, size, 1);
+        node_t * epilogue = nextNode(n);
+        epilogue->size = 0;
+        epilogue->used = 1;
+        epilogue->mmapped = 0;
+      }
+    }
+
+    if (n->size >= size) {
+      shrinkNode(arena, n, size);
+      return ptr;
+    }
+  }
+  else if (n->size >= size) {
+    //a large block already has whole pages
+    return ptr;
+  }
+
+  //4. move the data to a new block
+  void * new_ptr = arena_malloc(arena, size, fit);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, n->size < size ? n->size : size);
+  my_free(arena, ptr);
+  return new_ptr;
+}
+
+/*
+Serve a large request with its own mapping
+the mapping is whole pages: padding + header + payload, the payload gets the rest
+*/
+void * mmap_malloc(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t length = (ALIGNMENT + size + page - 1) & ~(page - 1);
+
+  char * start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) {
+    return NULL;
+  }
+
+  //the mapping is page aligned, the header is moved up so that the
+  //payload starts ALIGNMENT bytes in
+  node_t * n = (node_t *)(start + ALIGNMENT - NODE_SIZE);
+  n->size = length - ALIGNMENT;
   n->used = 1;
+  n->mmapped = 1;
 
-  head = n;
-  tail = n;
+  __atomic_add_fetch(&mmapped_size, length, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mmapped_count, 1, __ATOMIC_RELAXED);
 
-  return res;
+  return start + ALIGNMENT;
 }
 
 /*
-  this function will search through the LinkedList to search the first node   
-  that can fit the request
-  
-  rerturn:
-  if there is: return the pointer to the node
-  else:  return NULL
+Serve a large aligned request with its own mapping
+The mapping has room to move the payload up to the alignment, then the
+whole pages in front of the header and after the payload are unmapped.
 */
-node_t * first_fit(size_t size) {
-  if (head == NULL) {
+void * mmap_memalign(size_t alignment, size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t length = (NODE_SIZE + size + alignment + page - 1) & ~(page - 1);
+
+  char * start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) {
     return NULL;
   }
 
-  node_t * cur = head;
+  char * q = (char *)(((uintptr_t)start + NODE_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+  node_t * n = (node_t *)(q - NODE_SIZE);
+  char * first = (char *)((uintptr_t)n & ~(page - 1));
+  char * last = (char *)(((uintptr_t)q + size + page - 1) & ~(page - 1));
+  if (first > start) {
+    munmap(start, first - start);
+  }
+  if (last < start + length) {
+    munmap(last, start + length - last);
+  }
+
+  n->size = last - q;
+  n->used = 1;
+  n->mmapped = 1;
+
+  __atomic_add_fetch(&mmapped_size, last - first, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mmapped_count, 1, __ATOMIC_RELAXED);
+
+  return q;
+}
+
+/*
+Unmap the large block n
+the mapping starts at the page of the header and ends with the payload
+*/
+void mmap_free(node_t * n) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  char * first = (char *)((uintptr_t)n & ~(page - 1));
+  size_t length = (char *)n + NODE_SIZE + n->size - first;
+
+  __atomic_sub_fetch(&mmapped_size, length, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&mmapped_count, 1, __ATOMIC_RELAXED);
+
+  munmap(first, length);
+}
+
+/*
+free for callers that know the size they asked for: a slot is freed
+without looking at any header. With -DCHECK_SIZE the size is checked
+against the block.
+*/
+void sized_free(arena_t * arena, void * ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+  //without CHECK_SIZE and SLAB the size is not needed
+  (void)size;
+#ifdef CHECK_SIZE
+  check_size(ptr, size);
+#endif
+#ifdef SLAB
+  //only a small request can have been given a slot
+  if (size <= SLAB_MAX_SIZE) {
+    slab_t * slab = slabOf(ptr);
+    if (slab != NULL) {
+      slab_free(slab, ptr);
+      return;
+    }
+  }
+#endif
+  my_free(arena, ptr);
+}
+
+/*
+malloc count blocks of size bytes on one arena into out:
+every node that fit finds is cut into as many blocks as it holds, and
+taken out of (and put back into) the free indexes only once. Whatever
+is left comes from a single heap growth.
+return how many blocks were allocated
+*/
+size_t arena_malloc_batch(arena_t * arena, size_t size, size_t count, void ** out, fit_t fit) {
+  if (size > MAX_REQUEST) {
+    return 0;
+  }
+  size = adjust_size(size);
+  size_t done = 0;
+
+  //large blocks have their own mappings anyway
+  if (size >= mmap_threshold) {
+    while (done < count && (out[done] = mmap_malloc(size)) != NULL) {
+      done++;
+    }
+    return done;
+  }
 
+  //1. every node that fits gives as many blocks as it holds
+  size_t stride = NODE_SIZE + size + FOOTER_SIZE;
+  if (count > MAX_REQUEST / stride) {
+    return 0;
+  }
+  node_t * n;
+#ifdef DEFERRED
+  //nodes of exactly this size on the quick list come first
+  int cls = quick_class(size);
+  while (done < count && cls >= 0 && (n = arena->quick[cls]) != NULL) {
+    arena->quick[cls] = FREE_LINK(n)->next;
+    arena->quick_bytes -= n->size;
+    arena->quick_count--;
+    arena->free_space -= n->size;
+    arena->used_count++;
+    out[done++] = (char *)n + NODE_SIZE;
+  }
+#endif
+  while (done < count && (n = fit(arena, size)) != NULL) {
+    done += carveNodes(arena, n, size, count - done, out + done);
+  }
+
+#ifdef DEFERRED
+  if (done < count && arena->quick_bytes > 0) {
+    //merge the quick lists before the heap grows
+    arena_consolidate(arena);
+    while (done < count && (n = fit(arena, size)) != NULL) {
+      done += carveNodes(arena, n, size, count - done, out + done);
+    }
+  }
+#endif
+
+  //2. the heap grows once for the rest
+  if (done < count) {
+    n = makeSpaceForNode(arena, (count - done) * stride - NODE_SIZE - FOOTER_SIZE);
+    if (n != NULL) {
+      done += carveNodes(arena, n, size, count - done, out + done);
+    }
+  }
+  return done;
+}
+
+/*
+Cut blocks of size bytes off the front of the free node n into out,
+at most count of them; the rest of n stays free
+return how many blocks were cut
+*/
+size_t carveNodes(arena_t * arena, node_t * n, size_t size, size_t count, void ** out) {
+  //n is taken out of the free indexes once, not once per block
+  removeFreeNode(arena, n);
+
+  size_t done = 0;
+  while (done < count && n->size >= size) {
+    out[done++] = (char *)n + NODE_SIZE;
+    arena->used_count++;
+    if (n->size - size < NODE_SIZE + MIN_PAYLOAD + FOOTER_SIZE) {
+      //the rest is too small to record, the last block takes it
+      setNode(n, n->size, 1);
+      arena->free_space -= n->size;
+      return done;
+    }
+    //same split as splitNode: n keeps the front, the rest follows it
+    size_t rest = n->size - size - NODE_SIZE - FOOTER_SIZE;
+    setNode(n, size, 1);
+    arena->free_space -= size;
+    n = nextNode(n);
+    setNode(n, rest, 0);
+  }
+
+  addFreeNode(arena, n);
+  return done;
+}
+
+/*
+free count blocks of one arena, ptrs must be sorted by address.
+Blocks that follow each other in memory are joined first, so a run of
+them is merged with its neighbours and indexed only once.
+*/
+void arena_free_batch(arena_t * arena, void ** ptrs, size_t count) {
+  size_t i = 0;
+  while (i < count) {
+    void * ptr = ptrs[i++];
+    if (ptr == NULL) {
+      continue;
+    }
+#ifdef SLAB
+    slab_t * slab = slabOf(ptr);
+    if (slab != NULL) {
+      slab_free(slab, ptr);
+      continue;
+    }
+#endif
+    node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
+    if (n->mmapped) {
+      mmap_free(n);
+      continue;
+    }
+
+    //1. find the run of blocks right after n
+    node_t * last = n;
+    size_t joined = 0;
+    while (i < count && ptrs[i] == (char *)nextNode(last) + NODE_SIZE) {
+      last = nextNode(last);
+      joined++;
+      i++;
+    }
+
+    //2. the run becomes one used node, the tags inside it become payload
+    if (joined > 0) {
+      arena->free_space -= joined * (NODE_SIZE + FOOTER_SIZE);
+      arena->used_count -= joined;
+      setNode(n, (char *)footerOf(last) - ((char *)n + NODE_SIZE), 1);
+    }
+
+    //3. free it like any other node
+    my_free(arena, ptr);
+  }
+}
+
+/*
+Sort count pointers by address (heapsort: qsort may call malloc),
+small batches with insertion sort
+*/
+void sortPointers(void ** ptrs, size_t count) {
+  //a small batch is sorted faster by insertion
+  if (count <= SORT_INSERTION_MAX) {
+    for (size_t i = 1; i < count; i++) {
+      void * ptr = ptrs[i];
+      size_t j = i;
+      while (j > 0 && (uintptr_t)ptrs[j - 1] > (uintptr_t)ptr) {
+        ptrs[j] = ptrs[j - 1];
+        j--;
+      }
+      ptrs[j] = ptr;
+    }
+    return;
+  }
+
+  //1. build a max heap
+  for (size_t start = count / 2; start-- > 0;) {
+    siftDown(ptrs, start, count);
+  }
+  //2. move the biggest to the end, one at a time
+  for (size_t end = count; end-- > 1;) {
+    void * tmp = ptrs[0];
+    ptrs[0] = ptrs[end];
+    ptrs[end] = tmp;
+    siftDown(ptrs, 0, end);
+  }
+}
+
+//Move ptrs[i] down the max heap ptrs[0, count) to its place
+void siftDown(void ** ptrs, size_t i, size_t count) {
+  while (2 * i + 1 < count) {
+    size_t child = 2 * i + 1;
+    if (child + 1 < count && (uintptr_t)ptrs[child + 1] > (uintptr_t)ptrs[child]) {
+      child++;
+    }
+    if ((uintptr_t)ptrs[i] >= (uintptr_t)ptrs[child]) {
+      return;
+    }
+    void * tmp = ptrs[i];
+    ptrs[i] = ptrs[child];
+    ptrs[child] = tmp;
+    i = child;
+  }
+}
+
+/*
+assert that a block of size bytes fits in the block at ptr
+(the block may be bigger, a node is only split if the rest is a node)
+*/
+void check_size(void * ptr, size_t size) {
+#ifdef SLAB
+  slab_t * slab = slabOf(ptr);
+  if (slab != NULL) {
+    assert(size <= slab->size);
+    return;
+  }
+#endif
+  node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
+  assert(adjust_size(size) <= n->size);
+}
+
+/*
+Round the request up so that a freed node can hold its free list links
+and every boundary tag stays aligned
+*/
+size_t adjust_size(size_t size) {
+  //the node must be able to hold its free list links once it is freed
+  if (size < MIN_PAYLOAD) {
+    return MIN_PAYLOAD;
+  }
+  return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+//Write the header and the footer of node n
+void setNode(node_t * n, size_t size, int used) {
+  n->size = size;
+  n->used = used;
+  n->mmapped = 0;
+  *footerOf(n) = *n;
+}
+
+//Return the footer of node n
+node_t * footerOf(node_t * n) {
+  return (node_t *)((char *)n + NODE_SIZE + n->size);
+}
+
+//Return the node physically after n
+node_t * nextNode(node_t * n) {
+  return (node_t *)((char *)n + NODE_SIZE + n->size + FOOTER_SIZE);
+}
+
+//Return the node physically before n
+node_t * prevNode(node_t * n) {
+  node_t * prev_footer = (node_t *)((char *)n - FOOTER_SIZE);
+  return (node_t *)((char *)prev_footer - prev_footer->size - NODE_SIZE);
+}
+
+/*
+This function will grow the heap by one chunk that can hold a node with
+size bytes of payload. If the program break is still where our heap
+ends, the chunk extends the free tail (or replaces the old epilogue).
+Otherwise a new segment with its own prologue and epilogue is started.
+return the pointer to the new free node, NULL if sbrk fails
+*/
+node_t * makeSpaceForNode(arena_t * arena, size_t size) {
+  size_t total = NODE_SIZE + size + FOOTER_SIZE;
+  size_t chunk = (heap_chunk == 0) ? 0 : (arena->chunk > heap_chunk) ? arena->chunk : heap_chunk;
+  node_t * n;
+  size_t need;
+  size_t increment;
+  //bytes skipped in front of a new segment to align its first payload
+  size_t pad = 0;
+  char * brk = my_sbrk(arena, 0);
+
+  if (arena->heap_end != NULL && brk == arena->heap_end) {
+    //1. the heap is still contiguous: the free tail (or else the old
+    //epilogue) is the start of the new node
+    node_t * epilogue = (node_t *)(arena->heap_end - NODE_SIZE);
+    node_t * tail_footer = (node_t *)((char *)epilogue - FOOTER_SIZE);
+    size_t have = 0;
+    n = epilogue;
+    if (tail_footer->used == 0) {
+      n = prevNode(epilogue);
+      removeFreeNode(arena, n);
+      have = NODE_SIZE + n->size + FOOTER_SIZE;
+    }
+    need = total - have;
+  }
+  else {
+    //2. first call, or somebody else moved the break: start a new segment
+    //with a prologue footer and an epilogue header around the node.
+    //The segment starts at a multiple of ALIGNMENT, so its payloads do
+    pad = -(uintptr_t)brk & (ALIGNMENT - 1);
+    need = FOOTER_SIZE + total + NODE_SIZE;
+    n = NULL;
+  }
+
+  //3. grow by a whole chunk if we can, by what is missing otherwise
+  increment = pad + ((need > chunk) ? need : chunk);
+  char * start = my_sbrk(arena, increment);
+  if (start == (void *)-1 && increment > pad + need) {
+    increment = pad + need;
+    start = my_sbrk(arena, increment);
+  }
+  if (start == (void *)-1) {
+    if (n != NULL && n != (node_t *)(arena->heap_end - NODE_SIZE)) {
+      //the free tail goes back to the free indexes
+      addFreeNode(arena, n);
+    }
+    return NULL;
+  }
+  arena->chunk = (chunk < HEAP_CHUNK_MAX) ? chunk * 2 : chunk;
+
+  if (n == NULL) {
+    //prologue footer: a used node of size 0 in front of the first node
+    //(the pad bytes in front of it are counted as free space)
+    node_t * prologue = (node_t *)(start + pad);
+    prologue->size = 0;
+    prologue->used = 1;
+    prologue->mmapped = 0;
+    n = (node_t *)(start + pad + FOOTER_SIZE);
+    arena->heap_end = start;
+  }
+  arena->heap_end += increment;
+  //every new byte is free space, tags included
+  arena->free_space += increment;
+
+  //4. the node runs up to the new epilogue
+  setNode(n, arena->heap_end - NODE_SIZE - FOOTER_SIZE - ((char *)n + NODE_SIZE), 0);
+  addFreeNode(arena, n);
+
+  //the epilogue header: a used node of size 0 at the end of the segment
+  node_t * epilogue = nextNode(n);
+  epilogue->size = 0;
+  epilogue->used = 1;
+  epilogue->mmapped = 0;
+
+  return n;
+}
+
+/*
+  this function will search through the free list to search the first node
+  that can fit the request. It starts at the bin of the request and takes
+  the head of the next non-empty bin if nothing in that bin is big enough.
+
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
+*/
+node_t * first_fit(arena_t * arena, size_t size) {
+  STAT_ADD(searches, 1);
+  int bin = get_bin(size);
+
+  //1. nodes in the bin of the request may still be too small
+  node_t * cur = arena->bins[bin];
   while (cur != NULL) {
-    if (cur->used == 0 && cur->size >= size) {
+    STAT_ADD(nodes_visited, 1);
+    if (cur->size >= size) {
       //return the first fit
       return cur;
     }
-    //else move to the next node
-    cur = cur->next;
+    //else move to the next free node
+    cur = FREE_LINK(cur)->next;
   }
-  //we are here beacause cur == NULL, which means there is no fit
 
-  return cur;
+  //2. find the next non-empty bin with the bitmap,
+  //every node there is big enough
+  unsigned long bigger = (bin + 1 < NUM_BINS) ? arena->bin_map & (~0UL << (bin + 1)) : 0;
+  if (bigger == 0) {
+    //there is no fit
+    return NULL;
+  }
+  return arena->bins[__builtin_ctzl(bigger)];
 }
 
 /*
-this function will be called when there is no fit found in the heap   
-and we have to increase the heap to give the user requested memo      
-return the address of the space requested by the user                 
+  next fit: like first fit, but the search starts at the rover, the
+  node the previous search stopped at, and wraps around the free list
+  (the bins one after another) back to it. The bins below the bin of
+  the request are skipped. Removing the rover from the free list moves
+  it on to the next node.
+
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
 */
-void * incr_heap(size_t size) {
-  //1. make space for node
-  node_t * n = makeSpaceForNode();
+node_t * next_fit(arena_t * arena, size_t size) {
+  STAT_ADD(searches, 1);
+  //the bins below the bin of the request are all too small
+  int low = get_bin(size);
+  unsigned long fitting = arena->bin_map & (~0UL << low);
+  if (fitting == 0) {
+    return NULL;
+  }
 
-  //2. make space for the user
-  void * res = my_sbrk(size);
-  n->size = size;
-  n->used = 1;
+  node_t * start = arena->rover;
+  if (start == NULL || get_bin(start->size) < low) {
+    //start at the first free node that may fit
+    start = arena->bins[__builtin_ctzl(fitting)];
+  }
 
-  //3. add the node to the tail of Linked List
-  addToTail(n);
+  node_t * cur = start;
+  do {
+    STAT_ADD(nodes_visited, 1);
+    if (cur->size >= size) {
+      //the next search starts here, splitNode moves it past this node
+      arena->rover = cur;
+      return cur;
+    }
+    cur = nextFreeNode(arena, cur, low);
+  } while (cur != start);
+
+  //there is no fit
+  return NULL;
+}
 
-  //4. return the address requested by the user
-  return res;
+/*
+Return the free node after n in the free list, going on with the next
+non-empty bin and wrapping around to bin low
+*/
+node_t * nextFreeNode(arena_t * arena, node_t * n, int low) {
+  if (FREE_LINK(n)->next != NULL) {
+    return FREE_LINK(n)->next;
+  }
+  int bin = get_bin(n->size);
+  unsigned long after = (bin + 1 < NUM_BINS) ? arena->bin_map & (~0UL << (bin + 1)) : 0;
+  if (after == 0) {
+    //wrap around to the first bin that may fit
+    after = arena->bin_map & (~0UL << low);
+  }
+  return arena->bins[__builtin_ctzl(after)];
 }
 
-void addToTail(node_t * n) {
-  n->prev = tail;
-  tail->next = n;
-  n->next = NULL;
-  tail = n;
+/*
+  good fit: walk the free list from the bin of the request and return
+  the first node that wastes at most good_fit_slack percent of size,
+  otherwise the smallest fitting node among the first
+  good_fit_candidates nodes visited, otherwise the best fit.
+  The bins are LIFO, so the walk visits the most recently freed nodes,
+  not the lowest addresses.
+
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
+*/
+node_t * good_fit(arena_t * arena, size_t size) {
+  STAT_ADD(searches, 1);
+  node_t * best = NULL;
+  size_t slack = size * good_fit_slack / 100;
+  size_t visited = 0;
+
+  //1. walk the bins that may fit, until the budget is spent
+  unsigned long bins = arena->bin_map & (~0UL << get_bin(size));
+  while (bins != 0 && visited < good_fit_candidates) {
+    node_t * cur = arena->bins[__builtin_ctzl(bins)];
+    bins &= bins - 1;
+    while (cur != NULL && visited < good_fit_candidates) {
+      visited++;
+      STAT_ADD(nodes_visited, 1);
+      if (cur->size >= size) {
+        if (cur->size - size <= slack) {
+          //good enough, stop here
+          return cur;
+        }
+        if (best == NULL || cur->size < best->size) {
+          best = cur;
+        }
+      }
+      cur = FREE_LINK(cur)->next;
+    }
+  }
+
+  //2. nothing visited fits, the tree finds the best fit if there is one
+  if (best == NULL) {
+    best = best_fit(arena, size);
+  }
+  return best;
 }
 
-/*                                                                            
-Because we find a matched space in the linkedlist, we now have to give the    
-space the user requested. Here are two cases:                                 
-    1. After we split the node, the rest of the space is too small to record  
-       In this situation, we just give the user the whole space, which means  
-       We do not split the node.                                              
-    2. Else the rest of the node is still very big, we can split the node     
-       And set the rest of the node as available.                             
-                                                                              
-    return: return the adrress of the space that the user requested.          
+/*
+this function will be called when there is no fit found in the heap
+and we have to increase the heap to give the user requested memo
+return the address of the space requested by the user
 */
-void * splitNode(node_t * n, size_t size) {
+void * incr_heap(arena_t * arena, size_t size) {
+  //1. make space for the node and the user
+  node_t * n = makeSpaceForNode(arena, size);
+  if (n == NULL) {
+    return NULL;
+  }
+
+  //2. the user gets the front of the new free node, the rest stays free
+  return splitNode(arena, n, size);
+}
+
+/*
+Because we find a matched space in the free list, we now have to give the
+space the user requested. Here are two cases:
+    1. After we split the node, the rest of the space is too small to record
+       In this situation, we just give the user the whole space, which means
+       We do not split the node.
+    2. Else the rest of the node is still very big, we can split the node
+       And set the rest of the node as available.
+
+    return: return the adrress of the space that the user requested.
+*/
+void * splitNode(arena_t * arena, node_t * n, size_t size) {
+  //n is no longer free, take it out of the free indexes
+  removeFreeNode(arena, n);
+  arena->used_count++;
   //1. check whether the splited node is too small to record
-  if (n->size - size > NODE_SIZE) {
+  //   (in every build: a free node holds its links in the payload)
+  if (n->size - size >= NODE_SIZE + MIN_PAYLOAD + FOOTER_SIZE) {
     //we can record the splited node
+    STAT_ADD(splits, 1);
+    size_t split_size = n->size - size - NODE_SIZE - FOOTER_SIZE;
 
-    //get the pointer of the splited node
-    node_t * split = (node_t *)((char *)n + size + NODE_SIZE);
-    //node_t * split = (node_t *)(ptrByteMove(n, sizeof(node_t) + size, 1));
-    //insert split between n and n->next
-    split->prev = n;
-    split->next = n->next;
-
-    n->next = split;
-    if (split->next == NULL) {
-      //split now is the tail
-      tail = split;
-    }
-    else {
-      //split is not the tail, change the prev pointer of its next node
-      split->next->prev = split;
-    }
+    //n keeps the front part, its new footer goes right after the request
+    setNode(n, size, 1);  //n is now being used
 
-    //change the size and used property of n and split
-    split->size = n->size - size - NODE_SIZE;
-    split->used = 0;  //split is free for use
-    n->size = size;
-    n->used = 1;  //n is now being used
+    //the splited node starts right after the new footer of n
+    node_t * split = nextNode(n);
+    setNode(split, split_size, 0);  //split is free for use
+    addFreeNode(arena, split);
 
-    free_space -= size;
+    arena->free_space -= size;
   }
   else {
     //first case: do not need to split
-    n->used = 1;
-    free_space -= n->size;
+    setNode(n, n->size, 1);
+    arena->free_space -= n->size;
   }
 
   //return the address the user requests
-  //return ptrByteMove(n, sizeof(node_t), 1);
   return (void *)((char *)n + NODE_SIZE);
 }
 
-/*                                                                   
-my_sbrk is the same as sbrk, except that every time we call sbrk     
-The change of the heap size will be accumulated into the global      
-variable heap_size                                                   
+/*
+my_sbrk is the same as sbrk, except that every time we call sbrk
+The change of the heap size will be accumulated into the heap_size
+of the arena. The main arena moves the real program break, the other
+arenas move their own break inside the mapping they reserved.
 */
 
-void * my_sbrk(intptr_t increment) {
-  heap_size += increment;
+void * my_sbrk(arena_t * arena, intptr_t increment) {
+  void * prev_brk;
+  if (arena->base == NULL) {
+    prev_brk = sbrk(increment);
+  }
+  else if (increment > arena->limit - arena->brk) {
+    //the reserved mapping is used up
+    return (void *)-1;
+  }
+  else {
+    prev_brk = arena->brk;
+    arena->brk += increment;
+    if (increment < 0) {
+      //the mapping stays reserved, but the whole pages above the
+      //new break do not have to stay in memory
+      size_t page = sysconf(_SC_PAGESIZE);
+      char * first_page = (char *)(((uintptr_t)arena->brk + page - 1) & ~(page - 1));
+      if (first_page < (char *)prev_brk) {
+        madvise(first_page, (char *)prev_brk - first_page, MADV_DONTNEED);
+      }
+    }
+  }
+
+  if (prev_brk != (void *)-1) {
+    arena->heap_size += increment;
+    if (increment != 0) {
+      STAT_ADD(sbrk_calls, 1);
+    }
+  }
 
-  return sbrk(increment);
+  return prev_brk;
 }
 
 /*
 This function will help us free the allocated memo
-1.When there is free node next, we will merge the free node with current node
-2.When there is free node previous, we will merge this node with the previous node  
+1.When the physical next node is free, we will merge it into the current node
+2.When the physical previous node is free, we will merge this node into it
 */
-void my_free(void * ptr) {
+void my_free(arena_t * arena, void * ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+#ifdef SLAB
+  //a slot has no node, its slab knows its size
+  slab_t * slab = slabOf(ptr);
+  if (slab != NULL) {
+    slab_free(slab, ptr);
+    return;
+  }
+#endif
   //1. Get the corresponding node pointer
-  //node_t * n = (node_t *)ptrByteMove(ptr, sizeof(node_t), -1);
   node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
-  //2. set the status of the node to unused
-  n->used = 0;
+  if (n->mmapped) {
+    //a large block is not part of any heap
+    mmap_free(n);
+    return;
+  }
   //because node n is freed, increase the free space
-  free_space += n->size;
+  arena->free_space += n->size;
+  arena->used_count--;
+
+#ifdef DEFERRED
+  //a small node waits on a quick list, still marked used
+  int cls = quick_class(n->size);
+  if (cls >= 0) {
+    FREE_LINK(n)->next = arena->quick[cls];
+    arena->quick[cls] = n;
+    arena->quick_bytes += n->size;
+    arena->quick_count++;
+    if (arena->quick_bytes > quick_threshold) {
+      arena_consolidate(arena);
+    }
+    return;
+  }
+  //a big free is a good moment to merge everything, so the tail can be trimmed
+  if (n->size >= QUICK_CONSOLIDATE_SIZE && arena->quick_bytes > 0) {
+    arena_consolidate(arena);
+  }
+#endif
+
+  coalesceNode(arena, n);
+}
 
-  //3. check whether the next node is free
-  node_t * next = n->next;
-  if (next != NULL && next->used == 0) {
+/*
+Mark the used node n free, merge it with its free neighbours, index it
+and trim the heap if it became a big free tail
+(the free space must already count n)
+*/
+void coalesceNode(arena_t * arena, node_t * n) {
+  //1. set the status of the node to unused
+  setNode(n, n->size, 0);
+
+  //2. check whether the next node is free
+  //(the epilogue is always used, so this never leaves the segment)
+  node_t * next = nextNode(n);
+  if (next->used == 0) {
+    removeFreeNode(arena, next);
     //merge the next node into node n
     merge(n, next);
   }
 
-  //4. check whether the previous node is free
-  node_t * prev = n->prev;
-  if (prev != NULL && prev->used == 0) {
+  //3. check whether the previous node is free
+  //(the prologue is always used, so this never leaves the segment)
+  node_t * prev_footer = (node_t *)((char *)n - FOOTER_SIZE);
+  if (prev_footer->used == 0) {
+    node_t * prev = prevNode(n);
+    removeFreeNode(arena, prev);
     //merge node n into prev
     merge(prev, n);
+    n = prev;
   }
+
+  //4. the merged node has a new size, so it is indexed by that size
+  addFreeNode(arena, n);
+
+  //5. a big free tail is given back to the OS, except for one chunk
+  //   (the next growth step at least, or a request that needed that
+  //   growth would sbrk the same bytes again on every malloc/free)
+  if (n->size >= trim_threshold && (char *)nextNode(n) + NODE_SIZE == arena->heap_end) {
+    arena_trim(arena, (arena->chunk > heap_chunk) ? arena->chunk : heap_chunk);
+  }
+}
+
+//Return the quick list class of a node with size bytes of payload
+int quick_class(size_t size) {
+  if (size > QUICK_MAX_SIZE) {
+    return -1;
+  }
+  return (size - MIN_PAYLOAD) / ALIGNMENT;
+}
+
+//Merge every node on the quick lists of the arena into the heap
+void arena_consolidate(arena_t * arena) {
+  for (int i = 0; i < QUICK_CLASSES; i++) {
+    while (arena->quick[i] != NULL) {
+      node_t * n = arena->quick[i];
+      arena->quick[i] = FREE_LINK(n)->next;
+      coalesceNode(arena, n);
+    }
+  }
+  arena->quick_bytes = 0;
+  arena->quick_count = 0;
+}
+
+/*
+Give the free tail of the newest segment of the arena back to the OS,
+keeping pad bytes of it as a free node
+return 1 if the heap shrank, 0 otherwise
+*/
+int arena_trim(arena_t * arena, size_t pad) {
+  if (arena->heap_end == NULL) {
+    return 0;
+  }
+
+  //1. the tail is the node in front of the epilogue, it has to be free
+  node_t * epilogue = (node_t *)(arena->heap_end - NODE_SIZE);
+  node_t * tail_footer = (node_t *)((char *)epilogue - FOOTER_SIZE);
+  if (tail_footer->used) {
+    return 0;
+  }
+
+  //2. only shrink if nobody else moved the break after our heap
+  if (my_sbrk(arena, 0) != arena->heap_end) {
+    return 0;
+  }
+
+  node_t * tail = prevNode(epilogue);
+  size_t release;
+  removeFreeNode(arena, tail);
+  if (pad == 0) {
+    //3a. the whole tail goes away, its header becomes the new epilogue
+    release = NODE_SIZE + tail->size + FOOTER_SIZE;
+    epilogue = tail;
+  }
+  else {
+    //3b. keep pad bytes of the tail as a free node
+    size_t keep = adjust_size(pad);
+    if (keep >= tail->size) {
+      addFreeNode(arena, tail);
+      return 0;
+    }
+    release = tail->size - keep;
+    setNode(tail, keep, 0);
+    addFreeNode(arena, tail);
+    epilogue = nextNode(tail);
+  }
+  epilogue->size = 0;
+  epilogue->used = 1;
+  epilogue->mmapped = 0;
+
+  //4. move the break back, the released bytes were all free space
+  my_sbrk(arena, -(intptr_t)release);
+  arena->heap_end -= release;
+  arena->free_space -= release;
+
+  return 1;
+}
+
+/*
+malloc_trim for all arenas: give the free tail of every arena back to
+the OS, keeping pad bytes in each one (after the blocks on its remote
+free stack are freed)
+return 1 if any heap shrank, 0 otherwise
+*/
+int my_malloc_trim(size_t pad) {
+  int released = 0;
+  for (int i = 0; i < get_num_arenas(); i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+    arena_drain_remote(&arenas[i]);
+#ifdef DEFERRED
+    arena_consolidate(&arenas[i]);
+#endif
+    released |= arena_trim(&arenas[i], pad);
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  return released;
+}
+
+//Set the size from which a free tail is given back to the OS
+void set_trim_threshold(size_t bytes) {
+  trim_threshold = bytes;
 }
 
 //next node will be merged into n node
 void merge(node_t * n, node_t * next) {
-  //a. merge the next node with current node
-  n->size = n->size + sizeof(node_t) + next->size;
+  STAT_ADD(merges, 1);
+  //the tags between the two payloads become payload of n
+  setNode(n, n->size + FOOTER_SIZE + NODE_SIZE + next->size, 0);
+
+  //free_space deos not change, because the removed tags
+  //were also counted as free space
+}
+
+//Return the free_hist bucket of a free node with size bytes of payload
+int get_size_class(size_t size) {
+  if (size < ((size_t)1 << (MIN_BIN_SHIFT + 1))) {
+    return 0;
+  }
+  int bucket = (63 - __builtin_clzl(size)) - MIN_BIN_SHIFT;
+  return (bucket < HEAP_INFO_BUCKETS) ? bucket : HEAP_INFO_BUCKETS - 1;
+}
+
+/*
+Return the index of the bin that holds free nodes of this size
+The index is computed from the highest set bit, so it is O(1)
+*/
+int get_bin(size_t size) {
+  if (size < ((size_t)1 << (MIN_BIN_SHIFT + 1))) {
+    return 0;
+  }
+  int bin = (63 - __builtin_clzl(size)) - MIN_BIN_SHIFT;
+  if (bin >= NUM_BINS) {
+    //the last bin holds everything bigger
+    return NUM_BINS - 1;
+  }
+  return bin;
+}
+
+//Add the free node n to the head of its bin
+void addToBin(arena_t * arena, node_t * n) {
+  int bin = get_bin(n->size);
+  free_link_t * link = FREE_LINK(n);
+
+  link->prev = NULL;
+  link->next = arena->bins[bin];
+  if (arena->bins[bin] != NULL) {
+    FREE_LINK(arena->bins[bin])->prev = n;
+  }
+  arena->bins[bin] = n;
+  arena->bin_map |= 1UL << bin;
+}
 
-  //b. remove next node from the linked list
-  if (next->next == NULL) {
-    //next is the tail
-    n->next = NULL;
-    tail = n;
+//Remove the free node n from its bin
+void removeFromBin(arena_t * arena, node_t * n) {
+  int bin = get_bin(n->size);
+  free_link_t * link = FREE_LINK(n);
+
+  if (link->prev == NULL) {
+    //n is the head of the bin
+    arena->bins[bin] = link->next;
+    if (arena->bins[bin] == NULL) {
+      arena->bin_map &= ~(1UL << bin);
+    }
   }
   else {
-    //next is not the tail
-    n->next = next->next;
-    next->next->prev = n;
+    FREE_LINK(link->prev)->next = link->next;
+  }
+  if (link->next != NULL) {
+    FREE_LINK(link->next)->prev = link->prev;
+  }
+}
+
+//Add the free node n to both free indexes: its bin and the best-fit tree
+void addFreeNode(arena_t * arena, node_t * n) {
+  addToBin(arena, n);
+  arena->size_tree = treeInsert(arena->size_tree, n);
+  arena->free_count++;
+  arena->free_bytes += n->size;
+  arena->free_hist[get_size_class(n->size)]++;
+}
+
+//Remove the free node n from both free indexes
+void removeFreeNode(arena_t * arena, node_t * n) {
+  if (arena->rover == n) {
+    //next fit goes on with the node after n
+    arena->rover = FREE_LINK(n)->next;
+  }
+  removeFromBin(arena, n);
+  arena->size_tree = treeRemove(arena->size_tree, n);
+  arena->free_count--;
+  arena->free_bytes -= n->size;
+  arena->free_hist[get_size_class(n->size)]--;
+}
+
+//Return 1 if node a comes before node b in (size, address) order
+int nodeBefore(node_t * a, node_t * b) {
+  if (a->size != b->size) {
+    return a->size < b->size;
+  }
+  return a < b;
+}
+
+/*
+Return the treap priority of node n, a hash of its address
+(the splitmix64 finalizer: a plain multiply keeps evenly spaced nodes
+in order, and the treap degenerates towards a list)
+*/
+unsigned long treePriority(node_t * n) {
+  unsigned long x = (unsigned long)n;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9UL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBUL;
+  return x ^ (x >> 31);
+}
+
+/*
+Insert node n into the subtree rooted at root
+n goes down like in a plain binary search tree, then it is rotated up
+while its priority is higher than the priority of its parent
+*/
+node_t * treeInsert(node_t * root, node_t * n) {
+  if (root == NULL) {
+    FREE_LINK(n)->left = NULL;
+    FREE_LINK(n)->right = NULL;
+    return n;
   }
 
-  //free_space deos not change, because the removed node
-  //is also free space
+  free_link_t * r = FREE_LINK(root);
+  if (nodeBefore(n, root)) {
+    r->left = treeInsert(r->left, n);
+    if (treePriority(r->left) > treePriority(root)) {
+      //rotate right: the left child becomes the root
+      node_t * child = r->left;
+      r->left = FREE_LINK(child)->right;
+      FREE_LINK(child)->right = root;
+      return child;
+    }
+  }
+  else {
+    r->right = treeInsert(r->right, n);
+    if (treePriority(r->right) > treePriority(root)) {
+      //rotate left: the right child becomes the root
+      node_t * child = r->right;
+      r->right = FREE_LINK(child)->left;
+      FREE_LINK(child)->left = root;
+      return child;
+    }
+  }
+  return root;
 }
 
-/*                                              
-Return the entire head memo in bytes            
+/*
+Remove node n from the subtree rooted at root
+n is found by its (size, address) key and replaced by the join of
+its two subtrees
+*/
+node_t * treeRemove(node_t * root, node_t * n) {
+  if (root == n) {
+    return treeJoin(FREE_LINK(n)->left, FREE_LINK(n)->right);
+  }
+
+  free_link_t * r = FREE_LINK(root);
+  if (nodeBefore(n, root)) {
+    r->left = treeRemove(r->left, n);
+  }
+  else {
+    r->right = treeRemove(r->right, n);
+  }
+  return root;
+}
+
+//Join two subtrees where every node of a comes before every node of b
+node_t * treeJoin(node_t * a, node_t * b) {
+  if (a == NULL) {
+    return b;
+  }
+  if (b == NULL) {
+    return a;
+  }
+
+  //the root with the higher priority stays on top
+  if (treePriority(a) > treePriority(b)) {
+    FREE_LINK(a)->right = treeJoin(FREE_LINK(a)->right, b);
+    return a;
+  }
+  FREE_LINK(b)->left = treeJoin(a, FREE_LINK(b)->left);
+  return b;
+}
+
+//Return the largest node of the best-fit tree rooted at root, NULL if empty
+node_t * treeLargest(node_t * root) {
+  if (root == NULL) {
+    return NULL;
+  }
+  while (FREE_LINK(root)->right != NULL) {
+    root = FREE_LINK(root)->right;
+  }
+  return root;
+}
+
+/*
+Return the first node of the subtree at cur, in (size, address) order,
+that is big enough and has room at an aligned address
+subtrees of nodes that are too small are skipped
+*/
+node_t * treeFindAligned(node_t * cur, size_t alignment, size_t size) {
+  while (cur != NULL) {
+    STAT_ADD(nodes_visited, 1);
+    if (cur->size < size) {
+      //cur and its left subtree are too small
+      cur = FREE_LINK(cur)->right;
+      continue;
+    }
+    //everything on the left comes before cur
+    node_t * found = treeFindAligned(FREE_LINK(cur)->left, alignment, size);
+    if (found != NULL) {
+      return found;
+    }
+    if (alignedPayload(cur, alignment, size) != NULL) {
+      return cur;
+    }
+    cur = FREE_LINK(cur)->right;
+  }
+  return NULL;
+}
+
+/*
+Return the arena that owns the block at ptr
+A block belongs to a secondary arena if it lies in the mapping of that
+arena, everything else belongs to the main arena.
+*/
+arena_t * arenaOf(void * ptr) {
+  int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+  for (int i = 1; i < count; i++) {
+    if ((char *)ptr >= arenas[i].base && (char *)ptr < arenas[i].limit) {
+      return &arenas[i];
+    }
+  }
+  return &arenas[0];
+}
+
+/*
+Return arena i, creating it (and every arena before it) if needed
+A new arena reserves ARENA_RESERVE bytes of address space with mmap,
+its heap grows inside that mapping like the main heap grows with sbrk.
+return NULL if the mapping fails
+*/
+arena_t * get_arena(int i) {
+  if (i < __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE)) {
+    return &arenas[i];
+  }
+
+  pthread_mutex_lock(&arenas_lock);
+  while (num_arenas <= i) {
+    arena_t * arena = &arenas[num_arenas];
+    char * base = mmap(NULL, ARENA_RESERVE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      pthread_mutex_unlock(&arenas_lock);
+      return NULL;
+    }
+    arena->base = base;
+    arena->brk = base;
+    arena->limit = base + ARENA_RESERVE;
+    pthread_mutex_init(&arena->lock, NULL);
+    //publish the arena only after it is set up, arenaOf reads it unlocked
+    __atomic_store_n(&num_arenas, num_arenas + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&arenas_lock);
+
+  return &arenas[i];
+}
+
+/*
+Return how many arenas exist
+*/
+int get_num_arenas() {
+  return __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+}
+
+/*
+Return the heap memo of arena i in bytes
+*/
+unsigned long get_arena_data_segment_size(int i) {
+  return arenas[i].heap_size;
+}
+
+/*
+Return the free space of arena i in bytes:
+usable free space + space occupied by meta-data
+*/
+unsigned long get_arena_data_segment_free_space_size(int i) {
+  return arenas[i].free_space;
+}
+
+//Fill info for arena i, under the lock of the arena
+void get_arena_heap_info(int i, heap_info_t * info) {
+  arena_t * arena = &arenas[i];
+  pthread_mutex_lock(&arena->lock);
+
+  info->free_bytes = arena->free_bytes;
+  info->quick_bytes = arena->quick_bytes;
+  info->slab_free = arena->slab_free;
+  info->in_use = arena->heap_size - arena->free_space;
+  //whatever else is free space is tags, segment ends and padding
+  info->metadata = arena->free_space - arena->free_bytes - arena->quick_bytes - arena->slab_free;
+  info->used_blocks = arena->used_count;
+  info->free_blocks = arena->free_count;
+  info->quick_blocks = arena->quick_count;
+  memcpy(info->free_hist, arena->free_hist, sizeof(info->free_hist));
+  node_t * largest = treeLargest(arena->size_tree);
+  info->largest_free = (largest == NULL) ? 0 : largest->size;
+
+  pthread_mutex_unlock(&arena->lock);
+
+  info->fragmentation = (info->free_bytes == 0) ? 0 : 1 - (double)info->largest_free / info->free_bytes;
+  info->mmapped_bytes = 0;
+  info->mmapped_blocks = 0;
+}
+
+//Fill info for all arenas together, and the large blocks
+void get_heap_info(heap_info_t * info) {
+  memset(info, 0, sizeof(*info));
+  for (int i = 0; i < get_num_arenas(); i++) {
+    heap_info_t arena;
+    get_arena_heap_info(i, &arena);
+    info->in_use += arena.in_use;
+    info->free_bytes += arena.free_bytes;
+    info->quick_bytes += arena.quick_bytes;
+    info->metadata += arena.metadata;
+    info->slab_free += arena.slab_free;
+    info->used_blocks += arena.used_blocks;
+    info->free_blocks += arena.free_blocks;
+    info->quick_blocks += arena.quick_blocks;
+    for (int j = 0; j < HEAP_INFO_BUCKETS; j++) {
+      info->free_hist[j] += arena.free_hist[j];
+    }
+    if (arena.largest_free > info->largest_free) {
+      info->largest_free = arena.largest_free;
+    }
+  }
+
+  //a node cannot span two arenas, so the largest one is measured against all of them
+  info->fragmentation = (info->free_bytes == 0) ? 0 : 1 - (double)info->largest_free / info->free_bytes;
+  info->mmapped_bytes = get_mmapped_size();
+  info->mmapped_blocks = get_mmapped_count();
+}
+
+//Set the size from which a request is served with its own mapping
+void set_mmap_threshold(size_t bytes) {
+  mmap_threshold = bytes;
+}
+
+//Set how many bytes the quick lists of an arena may hold before they are merged
+void set_quick_threshold(size_t bytes) {
+  quick_threshold = bytes;
+}
+
+//Set how much a node may waste, in percent of the request, for good fit to take it at once
+void set_good_fit_slack(size_t percent) {
+  good_fit_slack = percent;
+}
+
+//Set how many free nodes a good fit search visits at most, 0 makes it best fit
+void set_good_fit_candidates(size_t count) {
+  good_fit_candidates = count;
+}
+
+//Set the smallest chunk the heap grows by, 0 grows by exactly the node
+void set_heap_chunk(size_t bytes) {
+  heap_chunk = (bytes + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+//Return the bytes currently mapped for large blocks (headers included)
+unsigned long get_mmapped_size() {
+  return __atomic_load_n(&mmapped_size, __ATOMIC_RELAXED);
+}
+
+//Return how many large blocks are currently mapped
+unsigned long get_mmapped_count() {
+  return __atomic_load_n(&mmapped_count, __ATOMIC_RELAXED);
+}
+
+/*
+Return the entire heap memo in bytes, summed over all arenas
 */
 
 unsigned long get_data_segment_size() {
-  return heap_size;
+  unsigned long total = 0;
+  for (int i = 0; i < get_num_arenas(); i++) {
+    total += get_arena_data_segment_size(i);
+  }
+  return total;
 }
 
-/*                                              
-Return the free space in the heap:              
-usable free space + space occupied by meta-data 
-                                                
+/*
+Return the free space in the heap, summed over all arenas:
+usable free space + space occupied by meta-data
 */
 
 unsigned long get_data_segment_free_space_size() {
-  return free_space;
+  unsigned long total = 0;
+  for (int i = 0; i < get_num_arenas(); i++) {
+    total += get_arena_data_segment_free_space_size(i);
+  }
+  return total;
 }
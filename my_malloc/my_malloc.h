@@ -7,13 +7,25 @@ malloc will be implemented with linked list data structure to bookkeeping the
 status of heap memo                                                                 
 */
 
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #define MAX_INT 2147483647
 
-#define NODE_SIZE 32
+//bytes of the header in front of every payload
+#define NODE_SIZE 8
+//bytes of the footer behind every payload
+#define FOOTER_SIZE 8
+//every payload address and payload size is a multiple of ALIGNMENT
+//(enough for max_align_t and SIMD loads). Header + footer are 16 bytes,
+//so a split keeps the next payload aligned as well
+#define ALIGNMENT 16
 
 //first fit
 void * ff_malloc(size_t size);
@@ -26,68 +38,531 @@ void * bf_malloc(size_t size);
 
 void bf_free(void * ptr);
 
-/* Node data structure for Double Linked List*/
+//next fit: first fit that resumes where the previous search stopped
 
-//create node structure
-typedef struct node_tag {
-  struct node_tag * next;
-  struct node_tag * prev;
+void * nf_malloc(size_t size);
 
-  //how many bytes requested by the user
-  size_t size;
+void nf_free(void * ptr);
+
+//good fit: takes the first block that wastes little, or the best of a few
+
+void * gf_malloc(size_t size);
+
+void gf_free(void * ptr);
+
+//resize a block, in place when the heap allows it
+void * ff_realloc(void * ptr, size_t size);
+
+void * bf_realloc(void * ptr, size_t size);
+
+void * nf_realloc(void * ptr, size_t size);
+
+void * gf_realloc(void * ptr, size_t size);
+
+//malloc whose payload address is a multiple of alignment (a power of two)
+void * ff_memalign(size_t alignment, size_t size);
+
+void * bf_memalign(size_t alignment, size_t size);
+
+//free with the size that was asked for when ptr was allocated (or resized)
+void ff_free_sized(void * ptr, size_t size);
+
+void bf_free_sized(void * ptr, size_t size);
+
+//allocate count blocks of size bytes into out, return how many were allocated
+size_t ff_malloc_batch(size_t size, size_t count, void ** out);
+
+size_t bf_malloc_batch(size_t size, size_t count, void ** out);
+
+//free count blocks, ptrs is sorted by address in place
+void ff_free_batch(void ** ptrs, size_t count);
+
+void bf_free_batch(void ** ptrs, size_t count);
+
+size_t nf_malloc_batch(size_t size, size_t count, void ** out);
+
+void nf_free_batch(void ** ptrs, size_t count);
+
+size_t gf_malloc_batch(size_t size, size_t count, void ** out);
+
+void gf_free_batch(void ** ptrs, size_t count);
+
+//thread safe (best fit behind a lock, with per-thread caches)
+
+void * ts_malloc(size_t size);
+
+void ts_free(void * ptr);
+
+void * ts_memalign(size_t alignment, size_t size);
+
+void * ts_realloc(void * ptr, size_t size);
+
+void ts_free_sized(void * ptr, size_t size);
+
+size_t ts_malloc_batch(size_t size, size_t count, void ** out);
+
+void ts_free_batch(void ** ptrs, size_t count);
+
+/* Boundary Tags */
+
+/*
+Every block of the heap looks like this:
+
+    | header | payload (size bytes) | footer |
+
+The header and the footer are the same boundary tag: the size of the
+payload and whether the block is used. The header of the next block
+comes right after the footer, so a node can find both physical
+neighbours in O(1):
+    next: right after our own footer
+    prev: the footer in front of our header tells how far back it is
+
+Because of that the heap does not need an address-ordered list of all
+the nodes, and a used block only costs NODE_SIZE + FOOTER_SIZE bytes.
+
+Each contiguous heap segment starts with a used prologue footer and
+ends with a used epilogue header (both of size 0), so the first and
+last node never try to merge past the segment.
+*/
+typedef struct node_tag {
   //1-> these bytes are used, 0-> available for use
-  int used;
+  size_t used : 1;
+  //1-> a large block mapped on its own with mmap, it has no footer
+  size_t mmapped : 1;
+  //how many bytes of payload this node has
+  size_t size : 62;
 } node_t;
 
+/* Large Blocks */
+
+/*
+A request of at least mmap_threshold bytes does not go to any heap: it
+gets its own mapping with a header in front (mmapped = 1), and free()
+unmaps it again. So large blocks never pin the break or fragment the
+heap, and their memory goes back to the OS right away. They are not
+part of the data segment, get_mmapped_size() counts them separately.
+*/
+#define MMAP_THRESHOLD (128 * 1024)
+//set_mmap_threshold changes it at run time
+extern size_t mmap_threshold;
+
+//anything bigger can never be served, malloc returns NULL right away
+#define MAX_REQUEST ((size_t)1 << 60)
+
+/* Trimming */
+
+/*
+When a free makes the free tail of the newest segment at least
+trim_threshold bytes big, and nobody moved the break after our heap,
+the tail is given back to the OS with a negative my_sbrk. A secondary
+arena lowers its own break and drops the pages with madvise.
+my_malloc_trim() does the same on request for every arena.
+*/
+#define TRIM_THRESHOLD (128 * 1024)
+
+/* Heap Growth */
+
+/*
+A miss does not grow the heap by just the node it needs: the heap grows
+by a chunk of at least heap_chunk bytes (see set_heap_chunk), and the
+free rest of the chunk stays as the free tail of the heap, which the
+next requests are split from. Every growth of an arena doubles its next
+chunk, up to HEAP_CHUNK_MAX, so a program that keeps allocating only
+makes a handful of sbrk calls. A free tail that is already there is
+part of the new node, so only the missing bytes are added.
+A trim after a free keeps the next chunk (at least heap_chunk bytes) of
+the tail, so a free right after a growth does not give the chunk
+straight back, and a block bigger than heap_chunk that is malloc'ed and
+freed over and over does not grow and trim the heap every time.
+*/
+#define HEAP_CHUNK (64 * 1024)
+#define HEAP_CHUNK_MAX (1024 * 1024)
+
+/* Deferred Coalescing */
+
+/*
+With -DDEFERRED (make DEFERRED=1) my_free does not merge a small node:
+a node of up to QUICK_MAX_SIZE bytes is pushed on the quick list of its
+exact size, still marked used, so that the next malloc of that size
+pops it back without any split or merge. The quick lists are merged
+into the heap all at once (arena_consolidate) when a malloc finds no
+fit, when they hold more than quick_threshold bytes (see
+set_quick_threshold), when a node of QUICK_CONSOLIDATE_SIZE bytes or
+more is freed, and before a trim.
+Quick nodes count as free space.
+*/
+#define QUICK_MAX_SIZE 512
+#define QUICK_CLASSES ((int)((QUICK_MAX_SIZE - MIN_PAYLOAD) / ALIGNMENT) + 1)
+#define QUICK_THRESHOLD (1024 * 1024)
+#define QUICK_CONSOLIDATE_SIZE (64 * 1024)
+
+/* Good Fit */
+
+/*
+Good fit walks the free list like first fit, from the bin of the
+request on, but it only takes a node at once if the node wastes at most
+good_fit_slack percent of the request (see set_good_fit_slack).
+Otherwise it remembers the smallest node that fits, and gives up after
+good_fit_candidates nodes (see set_good_fit_candidates). If none of them
+fits, the best-fit tree search follows, so a miss costs the walk and
+best fit. This is a LIFO-bounded scan, not an address-ordered good fit:
+a free pushes the node on the head of its bin, so the walk sees the
+most recently freed nodes first, whatever their addresses. In the
+default build (one bin) it is the whole free list in that order.
+*/
+#define GOOD_FIT_SLACK 12
+#define GOOD_FIT_CANDIDATES 32
+
+/* Free List */
+
+/*
+Free nodes are also linked into an explicit free list, so a search only
+visits nodes that can actually be returned. The free list is split into
+NUM_BINS size-class bins: bin i holds free nodes whose size is in
+[2^(i+4), 2^(i+5)), the last bin also holds everything bigger.
+The default build has a single bin, which is a plain explicit free list.
+A bin is LIFO (a freed node goes on its head), not address ordered, so
+first fit and good fit walk it from the most recently freed node.
+*/
+#ifdef SEGREGATED
+#define NUM_BINS 32
+#else
+#define NUM_BINS 1
+#endif
+#define MIN_BIN_SHIFT 4
+
+/*
+Free nodes are also kept in a treap (the best-fit tree) ordered by
+(size, address), so best_fit finds the smallest node that fits, and
+the lowest address among nodes of that size, in O(log n). This is
+exactly the node a scan of the whole heap would pick.
+The heap priority of a node is a hash of its address, mixed well
+enough that evenly spaced nodes get independent priorities, so the tree
+stays O(log n) deep (see general_tests/tree_depth_test).
+*/
+
+/*
+A free node keeps its free list links and its tree links at the start
+of its payload. Nobody uses the payload while the node is free, so the
+links cost no extra meta-data. This is also why every payload must be
+at least MIN_PAYLOAD bytes.
+*/
+typedef struct free_link_tag {
+  //free list
+  node_t * next;
+  node_t * prev;
+  //best-fit tree
+  node_t * left;
+  node_t * right;
+} free_link_t;
+
+#define MIN_PAYLOAD sizeof(free_link_t)
+#define FREE_LINK(n) ((free_link_t *)((char *)(n) + NODE_SIZE))
+
+/* Arena */
+
+/*
+An arena is one complete heap: its segments, its free indexes and its
+statistics. arenas[0] is the main arena, which grows with sbrk and is
+the heap of ff_malloc/bf_malloc. The thread safe allocator spreads its
+threads over more arenas, so threads on different arenas never wait for
+each other. A secondary arena reserves ARENA_RESERVE bytes of address
+space with mmap up front and moves its own break inside it, so every
+block knows its arena by its address alone.
+*/
+#define MAX_ARENAS 16
+#define ARENA_RESERVE (1UL << 30)
+//size classes of the free node histogram (see Heap Info)
+#define HEAP_INFO_BUCKETS 32
+
+typedef struct arena_tag {
+  //first byte after the epilogue of the newest heap segment
+  char * heap_end;
+  unsigned long heap_size;
+  unsigned long free_space;
+
+  //heads of the free list bins, the bins only hold free nodes
+  node_t * bins[NUM_BINS];
+  //bit i is set when bins[i] is not empty
+  unsigned long bin_map;
+  //root of the best-fit tree, it holds every free node as well
+  node_t * size_tree;
+  //next fit starts its search here, NULL means at the first free node
+  node_t * rover;
+
+  //the mapping of a secondary arena: [base, limit), brk is its break
+  //base is NULL for the main arena
+  char * base;
+  char * brk;
+  char * limit;
+
+  //bytes of the next growth, 0 until the first one
+  size_t chunk;
+
+  //quick lists of small freed nodes that are not merged yet (-DDEFERRED),
+  //linked through FREE_LINK(n)->next
+  node_t * quick[QUICK_CLASSES];
+  size_t quick_bytes;
+  unsigned long quick_count;
+
+  //kept up to date for get_heap_info: the nodes in the free indexes, their
+  //payload bytes and sizes (by size class), the used nodes (and slab slots),
+  //and the slab bytes that are not handed out (main arena only)
+  unsigned long free_count;
+  size_t free_bytes;
+  unsigned long free_hist[HEAP_INFO_BUCKETS];
+  unsigned long used_count;
+  size_t slab_free;
+
+  //taken by the thread safe allocator around every use of the arena
+  pthread_mutex_t lock;
+
+  //blocks freed by threads of other arenas, not yet given back: a stack
+  //linked through FREE_LINK(n)->next, pushed without the lock (see
+  //Thread Safe). On a cache line of its own, the other threads write it
+  node_t * remote_frees __attribute__((aligned(64)));
+} arena_t;
+
+extern arena_t arenas[MAX_ARENAS];
+extern pthread_mutex_t arenas_lock;
+
+//a fit policy: return a free node of the arena that fits size, or NULL
+typedef node_t * (*fit_t)(arena_t * arena, size_t size);
+//an aligned fit policy: return a free node of the arena that has room for
+//size bytes at an address that is a multiple of alignment, or NULL
+typedef node_t * (*aligned_fit_t)(arena_t * arena, size_t alignment, size_t size);
+
 /* Anxiliary Function */
 
 /*
-This function will allocate new space to hold the node    
-return the pointer to the node                            
+The body of ff/bf/nf/gf_malloc: the slab of size if there is one,
+otherwise arena_malloc on the main arena with fit (timed with -DSTATS)
 */
-node_t * makeSpaceForNode();
+void * policyMalloc(size_t size, fit_t fit);
 
 /*
-this function is used when malloc is called for the first time
-we init the Linked List as the current program break          
+The body of ff/bf/nf/gf_free: my_free on the main arena (timed with
+-DSTATS here, so the frees my_malloc does inside are not counted)
 */
-void * initLL(size_t size);
+void policyFree(void * ptr);
 
-/*                                                                          
-  this function will search through the LinkedList to search the first node 
-  that can fit the request                                                  
-                                                                            
-  rerturn:                                                                  
-  if there is: return the pointer to the node                               
-  else:  return NULL                                                        
+/*
+malloc on one arena with the given fit policy:
+search the free nodes of the arena with fit, split the node it finds,
+or increase the heap of the arena if there is no fit
 */
-node_t * first_fit(size_t size);
+void * arena_malloc(arena_t * arena, size_t size, fit_t fit);
 
-/*                                                                          
-  this function will search through the LinkedList to 
-  search the best fit node                                                   
-                                                                            
-  rerturn:                                                                  
-  if there is: return the pointer to the node                               
-  else:  return NULL                                                        
+/*
+Round the request up so that a freed node can hold its free list links
+and every boundary tag stays aligned
 */
-node_t * best_fit(size_t size);
+size_t adjust_size(size_t size);
 
-/*                                                                  
-this function will be called when there is no fit found in the heap 
-and we have to increase the heap to give the user requested memo    
-return the address of the space requested by the user               
+/*
+free for callers that know the size they asked for: a slot is freed
+without looking at any header. With -DCHECK_SIZE the size is checked
+against the block.
 */
-void * incr_heap(size_t size);
+void sized_free(arena_t * arena, void * ptr, size_t size);
 
 /*
-This function will help use add the node to the tail of the Linked List
+malloc count blocks of size bytes on one arena into out:
+every node that fit finds is cut into as many blocks as it holds, and
+taken out of (and put back into) the free indexes only once. Whatever
+is left comes from a single heap growth.
+return how many blocks were allocated
 */
+size_t arena_malloc_batch(arena_t * arena, size_t size, size_t count, void ** out, fit_t fit);
 
-void addToTail(node_t * n);
+/*
+Cut blocks of size bytes off the front of the free node n into out,
+at most count of them; the rest of n stays free
+return how many blocks were cut
+*/
+size_t carveNodes(arena_t * arena, node_t * n, size_t size, size_t count, void ** out);
+
+/*
+free count blocks of one arena, ptrs must be sorted by address.
+Blocks that follow each other in memory are joined first, so a run of
+them is merged with its neighbours and indexed only once.
+*/
+void arena_free_batch(arena_t * arena, void ** ptrs, size_t count);
 
 /*
-Because we find a matched space in the linkedlist, we now have to give the
+Sort count pointers by address (heapsort: qsort may call malloc),
+small batches with insertion sort
+*/
+#define SORT_INSERTION_MAX 64
+void sortPointers(void ** ptrs, size_t count);
+
+//Move ptrs[i] down the max heap ptrs[0, count) to its place
+void siftDown(void ** ptrs, size_t i, size_t count);
+
+/*
+assert that a block of size bytes fits in the block at ptr
+(the block may be bigger, a node is only split if the rest is a node)
+it reads the header, so the sized frees only call it with -DCHECK_SIZE
+*/
+void check_size(void * ptr, size_t size);
+
+/*
+malloc on one arena where the payload address is a multiple of alignment
+(a power of two). fit looks for a free node that already has room at an
+aligned address, only a miss grows the heap with room to move up. The
+gap in front of the aligned payload and the rest after it are freed
+again, so nothing is wasted.
+*/
+void * arena_memalign(arena_t * arena, size_t alignment, size_t size, aligned_fit_t fit);
+
+/*
+Shrink the used node n to size bytes of payload. If the rest is big
+enough to be a node, it is split off and freed (it may merge with the
+next node). Otherwise n keeps its size.
+*/
+void shrinkNode(arena_t * arena, node_t * n, size_t size);
+
+/*
+realloc on one arena, in place whenever possible:
+1. shrink: split off the rest of the node and free it
+2. grow into the physical next node if it is free and big enough
+3. grow the last node of the heap by moving the break
+only if none of these works, allocate with fit, copy and free
+*/
+void * arena_realloc(arena_t * arena, void * ptr, size_t size, fit_t fit);
+
+/*
+Serve a large request with its own mapping
+return the address of the payload, NULL if mmap fails
+*/
+void * mmap_malloc(size_t size);
+
+/*
+Serve a large aligned request with its own mapping
+return the address of the payload, NULL if mmap fails
+*/
+void * mmap_memalign(size_t alignment, size_t size);
+
+/*
+Unmap the large block n
+*/
+void mmap_free(node_t * n);
+
+/*
+Write the header and the footer of node n
+*/
+void setNode(node_t * n, size_t size, int used);
+
+/*
+Return the footer of node n
+*/
+node_t * footerOf(node_t * n);
+
+/*
+Return the node physically after n (the epilogue if n is the last node)
+*/
+node_t * nextNode(node_t * n);
+
+/*
+Return the node physically before n
+only valid when the footer in front of n is not the prologue
+*/
+node_t * prevNode(node_t * n);
+
+/*
+This function will grow the heap by one chunk that can hold a node with
+size bytes of payload. If the program break is still where our heap
+ends, the chunk extends the free tail (or replaces the old epilogue).
+Otherwise a new segment with its own prologue and epilogue is started.
+return the pointer to the new free node, NULL if sbrk fails
+*/
+node_t * makeSpaceForNode(arena_t * arena, size_t size);
+
+/*
+  this function will search through the free list to search the first node
+  that can fit the request. It starts at the bin of the request and takes
+  the head of the next non-empty bin if nothing in that bin is big enough.
+
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
+*/
+node_t * first_fit(arena_t * arena, size_t size);
+
+/*
+  next fit: like first fit, but the search starts at the rover, the
+  node the previous search stopped at, and wraps around the free list
+  (the bins one after another) back to it. The bins below the bin of
+  the request are skipped. Removing the rover from the free list moves
+  it on to the next node.
+
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
+*/
+node_t * next_fit(arena_t * arena, size_t size);
+
+/*
+Return the free node after n in the free list, going on with the next
+non-empty bin and wrapping around to bin low
+*/
+node_t * nextFreeNode(arena_t * arena, node_t * n, int low);
+
+/*
+  good fit: walk the free list from the bin of the request and return
+  the first node that wastes at most good_fit_slack percent of size,
+  otherwise the smallest fitting node among the first
+  good_fit_candidates nodes visited, otherwise the best fit.
+  The bins are LIFO, so the walk visits the most recently freed nodes,
+  not the lowest addresses.
+
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
+*/
+node_t * good_fit(arena_t * arena, size_t size);
+
+/*
+  this function will search the best-fit tree for the smallest
+  free node that can fit the request (lowest address on a tie).
+  The tree is O(log n) deep, so is the search.
+
+  rerturn:
+  if there is: return the pointer to the node
+  else:  return NULL
+*/
+node_t * best_fit(arena_t * arena, size_t size);
+
+/*
+Return the aligned payload address that node n would give to a request
+of size bytes: the payload itself if it is aligned, otherwise the first
+aligned address that leaves room for a free node in front of it.
+return NULL if the request does not fit there
+*/
+char * alignedPayload(node_t * n, size_t alignment, size_t size);
+
+/*
+first fit for an aligned request: the first free node, in first_fit
+order, that has room at an aligned address
+*/
+node_t * first_fit_aligned(arena_t * arena, size_t alignment, size_t size);
+
+/*
+best fit for an aligned request: the smallest free node (lowest address
+on a tie) that has room at an aligned address. The tree is walked in
+order from the smallest node that is big enough.
+*/
+node_t * best_fit_aligned(arena_t * arena, size_t alignment, size_t size);
+
+/*
+this function will be called when there is no fit found in the heap
+and we have to increase the heap to give the user requested memo
+return the address of the space requested by the user
+*/
+void * incr_heap(arena_t * arena, size_t size);
+
+/*
+Because we find a matched space in the free list, we now have to give the
 space the user requested. Here are two cases:
     1. After we split the node, the rest of the space is too small to record
        In this situation, we just give the user the whole space, which means
@@ -96,34 +571,545 @@ space the user requested. Here are two cases:
        And set the rest of the node as available.
     return: return the adrress of the space that the user requested.
 */
-void * splitNode(node_t * n, size_t size);
+void * splitNode(arena_t * arena, node_t * n, size_t size);
 
 /*
 my_sbrk is the same as sbrk, except that every time we call sbrk
-The change of the heap size will be accumulated into the global
-variable heap_size
+The change of the heap size will be accumulated into the heap_size
+of the arena. The main arena moves the real program break, the other
+arenas move their own break inside the mapping they reserved.
 */
 
-void * my_sbrk(intptr_t increment);
+void * my_sbrk(arena_t * arena, intptr_t increment);
 
 /*
 This function will help us free the allocated memo
-1.When there is free node next, we will merge the free node with current node
-2.When there is free node previous, we will merge this node with the previous node  
+1.When the physical next node is free, we will merge it into the current node
+2.When the physical previous node is free, we will merge this node into it
+With -DDEFERRED a small node goes to a quick list instead
+*/
+void my_free(arena_t * arena, void * ptr);
+
+/*
+Mark the used node n free, merge it with its free neighbours, index it
+and trim the heap if it became a big free tail
+(the free space must already count n)
+*/
+void coalesceNode(arena_t * arena, node_t * n);
+
+/*
+Return the quick list class of a node with size bytes of payload,
+-1 if nodes of that size are merged right away
+*/
+int quick_class(size_t size);
+
+/*
+Merge every node on the quick lists of the arena into the heap
 */
-void my_free(void * ptr);
+void arena_consolidate(arena_t * arena);
 
-//next node will be merged into n node
+//next node (physically right after n) will be merged into n node
 void merge(node_t * n, node_t * next);
 
 /*
-Return the entire head memo in bytes
+Give the free tail of the newest segment of the arena back to the OS,
+keeping pad bytes of it as a free node
+return 1 if the heap shrank, 0 otherwise
+*/
+int arena_trim(arena_t * arena, size_t pad);
+
+/*
+Return the index of the bin that holds free nodes of this size
+The index is computed from the highest set bit, so it is O(1)
+*/
+int get_bin(size_t size);
+
+/*
+Add the free node n to the head of its bin
+*/
+void addToBin(arena_t * arena, node_t * n);
+
+/*
+Remove the free node n from its bin
+*/
+void removeFromBin(arena_t * arena, node_t * n);
+
+/*
+Add the free node n to both free indexes: its bin and the best-fit tree
+*/
+void addFreeNode(arena_t * arena, node_t * n);
+
+/*
+Remove the free node n from both free indexes (and move the rover of
+next fit past it)
+must be called before the size of n changes, the tree is keyed by it
+*/
+void removeFreeNode(arena_t * arena, node_t * n);
+
+/* Best-Fit Tree */
+
+/*
+Return 1 if node a comes before node b in (size, address) order
+*/
+int nodeBefore(node_t * a, node_t * b);
+
+/*
+Return the treap priority of node n, a hash of its address
+*/
+unsigned long treePriority(node_t * n);
+
+/*
+Insert node n into the subtree rooted at root
+return: the new root of the subtree
+*/
+node_t * treeInsert(node_t * root, node_t * n);
+
+/*
+Remove node n from the subtree rooted at root
+return: the new root of the subtree
+*/
+node_t * treeRemove(node_t * root, node_t * n);
+
+/*
+Join two subtrees where every node of a comes before every node of b
+return: the root of the joined tree
+*/
+node_t * treeJoin(node_t * a, node_t * b);
+
+/*
+Return the first node of the subtree at cur, in (size, address) order,
+that is big enough and has room at an aligned address
+subtrees of nodes that are too small are skipped
+*/
+node_t * treeFindAligned(node_t * cur, size_t alignment, size_t size);
+
+/* Slabs */
+
+/*
+With -DSLAB (make SLAB=1) ff_malloc/bf_malloc serve requests of up to
+SLAB_MAX_SIZE bytes from slabs instead of the heap. A slab is SLAB_SIZE
+bytes aligned to SLAB_SIZE, cut into equal slots of one size class
+(a multiple of ALIGNMENT), with the slab_t in front of the first slot:
+
+    | slab_t | slot | slot | ... | slot |
+
+A slot has no header at all: free() knows a slot by its address lying
+in the slab region, and finds its slab by rounding the address down to
+SLAB_SIZE. Freed slots are linked through their first bytes, slots that
+were never used are handed out from the unused pointer. Slabs with a
+free slot are on the partial list of their class, a slab whose slots
+are all free goes to the empty list and can be reused by any class.
+The slabs are carved from one SLAB_RESERVE mapping, and are counted in
+the data segment of the main arena.
+Like ff_malloc/bf_malloc, slabs are not thread safe.
+*/
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MAX_SIZE 1024
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_RESERVE (1UL << 30)
+
+typedef struct slab_tag {
+  //partial list of the class, or the empty list
+  struct slab_tag * next;
+  struct slab_tag * prev;
+  //freed slots, linked through their first 8 bytes
+  void * free;
+  //first slot that was never handed out
+  char * unused;
+  //bytes of every slot
+  size_t size;
+  //slots handed out right now
+  size_t used;
+} slab_t;
+
+//the first slot starts this far into the slab, so it stays aligned
+#define SLAB_HEADER ((sizeof(slab_t) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+/*
+malloc from the slab of the size class of size (at most SLAB_MAX_SIZE)
+return NULL if no slab can be made, the caller then uses the heap
+*/
+void * slab_malloc(size_t size);
+
+/*
+free a slot that slabOf(ptr) returned a slab for
+*/
+void slab_free(slab_t * slab, void * ptr);
+
+/*
+Return the slab that holds ptr, NULL if ptr is not a slot
+*/
+slab_t * slabOf(void * ptr);
+
+/*
+Return a slab for slots of size bytes: an empty one if there is one,
+otherwise a new one from the slab region
+*/
+slab_t * slab_new(size_t size);
+
+/* Heap Info */
+
+/*
+A mallinfo-like picture of the heap. Every field is kept up to date as
+nodes are split, merged, used and freed, so reading it does not walk
+any list; only the largest free node is looked up, at the right end of
+the best-fit tree. The bytes of a heap add up:
+
+    heap size = in_use + free_bytes + quick_bytes + metadata + slab_free
+
+Blocks in a thread cache count as in use, like they do in the heap.
+free_hist[i] counts the free nodes with a payload in [2^(i+4), 2^(i+5)),
+the last bucket also the bigger ones.
+*/
+
+typedef struct heap_info_tag {
+  //payload bytes of the used nodes and slab slots
+  unsigned long in_use;
+  //payload bytes of the free nodes
+  unsigned long free_bytes;
+  //payload bytes on the quick lists (-DDEFERRED)
+  unsigned long quick_bytes;
+  //boundary tags, prologues, epilogues and alignment padding
+  unsigned long metadata;
+  //slab bytes that are not handed out, slab headers included (-DSLAB)
+  unsigned long slab_free;
+  unsigned long used_blocks;
+  unsigned long free_blocks;
+  unsigned long quick_blocks;
+  //payload bytes of the largest free node
+  unsigned long largest_free;
+  unsigned long free_hist[HEAP_INFO_BUCKETS];
+  //external fragmentation: the share of the free bytes that are not
+  //in the largest free node, 0 if there are none
+  double fragmentation;
+  //large blocks, which have their own mappings
+  unsigned long mmapped_bytes;
+  unsigned long mmapped_blocks;
+} heap_info_t;
+
+/*
+Fill info for arena i, under the lock of the arena
+*/
+void get_arena_heap_info(int i, heap_info_t * info);
+
+/*
+Fill info for all arenas together, and the large blocks
+*/
+void get_heap_info(heap_info_t * info);
+
+/*
+Return the free_hist bucket of a free node with size bytes of payload
+*/
+int get_size_class(size_t size);
+
+/*
+Return the largest node of the best-fit tree rooted at root, NULL if empty
+*/
+node_t * treeLargest(node_t * root);
+
+/* Statistics */
+
+/*
+With -DSTATS (make STATS=1) the allocator counts what it does, and
+times every ff/bf/nf/gf_malloc and ff/bf/nf/gf_free (sized or not) with
+CLOCK_MONOTONIC; the frees my_malloc does inside (a realloc that shrinks,
+a batch, a thread cache flush) are not timed.
+A latency goes into a log2 histogram: bucket i counts the calls that
+took [2^i, 2^(i+1)) ns, bucket 0 also counts the faster ones and the
+last bucket the slower ones. Everything is updated with relaxed atomics,
+so the ts_malloc threads can share it. A STATS build prints the
+statistics to stderr at exit.
+Without -DSTATS the STAT_ macros are empty and the statistics stay 0.
+*/
+#define STATS_BUCKETS 32
+
+typedef struct malloc_stats_tag {
+  //latency histograms of malloc and free
+  unsigned long malloc_ns[STATS_BUCKETS];
+  unsigned long free_ns[STATS_BUCKETS];
+  //fit searches, and the free nodes (list or tree) they looked at
+  unsigned long searches;
+  unsigned long nodes_visited;
+  //nodes cut in two, and pairs of neighbours joined into one
+  unsigned long splits;
+  unsigned long merges;
+  //my_sbrk calls that moved a break
+  unsigned long sbrk_calls;
+} malloc_stats_t;
+
+extern malloc_stats_t alloc_stats;
+
+#ifdef STATS
+#define STAT_ADD(field, n) __atomic_fetch_add(&alloc_stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_START(start) uint64_t start = stats_now()
+#define STAT_LATENCY(hist, start) stats_record(alloc_stats.hist, start)
+#else
+#define STAT_ADD(field, n)
+#define STAT_START(start)
+#define STAT_LATENCY(hist, start)
+#endif
+
+/*
+Return CLOCK_MONOTONIC in ns
+*/
+uint64_t stats_now();
+
+/*
+Add the time since start to the latency histogram hist
+*/
+void stats_record(unsigned long * hist, uint64_t start);
+
+/*
+Copy the statistics into stats
+*/
+void get_malloc_stats(malloc_stats_t * stats);
+
+/*
+Set every statistic back to 0
+*/
+void reset_malloc_stats();
+
+/*
+Print the counters, and the count, p50, p99 and p99.9 of both latency
+histograms (as the upper bound of their bucket) to out
+*/
+void print_malloc_stats(FILE * out);
+
+/*
+Return the upper bound in ns of the bucket of hist that holds the
+fraction q of the calls
+*/
+unsigned long statsPercentile(const unsigned long * hist, double q);
+
+/* Thread Safe */
+
+/*
+ff_malloc/bf_malloc and everything above are not thread safe: an arena
+is not locked and sbrk itself is not thread safe. ts_malloc and ts_free
+spread the threads round robin over one arena per core (at most
+MAX_ARENAS), run best fit on the arena of the thread under the lock of
+that arena, and free a block under the lock of the arena that owns it.
+In front of that every thread keeps a cache of free blocks:
+
+    tcache.blocks[i] is a stack of blocks with a payload of exactly
+    MIN_PAYLOAD + i * ALIGNMENT bytes, up to TCACHE_MAX_SIZE
+
+A cached block is still marked used in the heap, so no other thread
+can merge it away, and it can be handed out again without the lock.
+When a thread exits its cache is given back to the heap.
+
+A block that a thread frees to the heap of another arena (a worker that
+frees what a network thread malloc'ed) does not take the lock of that
+arena: it is pushed on arena->remote_frees with one CAS. The next
+ts_malloc on that arena that misses its cache, which holds the lock
+anyway, takes the whole stack with one exchange and frees it as a
+batch, so merging stays with the threads of the arena and the lock and
+the free indexes do not bounce between cores. Until then the blocks
+count as used, like cached ones; my_malloc_trim drains every arena.
+The stack is only ever emptied as a whole, so a push cannot meet a
+block that was popped and pushed again (ABA).
+*/
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_CLASSES ((int)((TCACHE_MAX_SIZE - MIN_PAYLOAD) / ALIGNMENT) + 1)
+//how many blocks a thread keeps per class before it frees to the heap
+#define TCACHE_MAX_COUNT 32
+//how many remote frees arena_drain_remote sorts and frees at once
+#define REMOTE_DRAIN_BATCH 64
+
+typedef struct tcache_tag {
+  //stacks of cached blocks, linked through FREE_LINK(n)->next
+  node_t * blocks[TCACHE_CLASSES];
+  unsigned count[TCACHE_CLASSES];
+} tcache_t;
+
+/*
+Return the arena of the calling thread, assigning one round robin on
+the first call
+*/
+arena_t * get_thread_arena();
+
+/*
+Create the pthread key whose destructor flushes a thread's cache
+(run once through pthread_once)
+*/
+void tcache_make_key();
+
+/*
+Return the tcache class of a block with size bytes of payload,
+-1 if blocks of that size are not cached
+*/
+int tcache_class(size_t size);
+
+/*
+Push the chain first ... last of freed blocks of arena (linked through
+FREE_LINK(n)->next) on its remote free stack, without the lock
+*/
+void remote_free(arena_t * arena, node_t * first, node_t * last);
+
+/*
+Push the count blocks of ptrs, all of arena, on its remote free stack
+as one chain (large blocks are unmapped instead)
+*/
+void remoteFreeBatch(arena_t * arena, void ** ptrs, size_t count);
+
+/*
+Free every block on the remote free stack of arena, the caller holds
+the lock of the arena
+*/
+void arena_drain_remote(arena_t * arena);
+
+/*
+Called by pthread when a thread that used its cache exits:
+gives every cached block back to the heap
+*/
+void tcache_flush(void * cache);
+
+/* Lock-free Classes */
+
+/*
+With -DLOCKFREE (make LOCKFREE=1) a small block that does not fit in the
+thread cache goes to a lock-free stack of its tcache class, shared by
+all threads, instead of back to its arena. ts_malloc pops a block of
+the class from there when the thread cache is empty, and only takes the
+lock of its arena when the stack is empty too, to carve LF_REFILL blocks
+of the class at once (arena_malloc_batch) and push all but one.
+
+The stacks are Treiber stacks. The top is one word that holds the
+payload address of the first block (shifted right by 4, payloads are
+16 byte aligned) and a tag in the top LF_TAG_BITS bits, which every push
+and pop increases:
+
+    | tag (20 bits) | payload >> 4 (44 bits) |
+
+A pop that read a block which was popped, used and pushed again in the
+meantime (ABA) sees another tag, so its CAS fails and it starts over.
+A block that was once on a stack never goes back to the heap (a realloc
+that has to move it copies it and frees it to the stack), so the stale
+next pointer that such a pop reads is always in mapped memory. Blocks on
+a stack count as used, like cached ones, and their memory is kept for
+small blocks for good, like slabs. A payload above 2^48 does not fit in
+the top and is freed to its arena as usual.
+*/
+#define LF_TAG_BITS 20
+#define LF_ADDRESS_BITS (64 - LF_TAG_BITS)
+//blocks carved from the arena when a stack is empty
+#define LF_REFILL 32
+
+//the top of one stack, on a cache line of its own
+typedef struct lf_stack_tag {
+  unsigned long top;
+} __attribute__((aligned(64))) lf_stack_t;
+
+extern lf_stack_t lf_stacks[TCACHE_CLASSES];
+
+/*
+Pop a block of tcache class cls from its stack
+return NULL if the stack is empty
+*/
+node_t * lf_pop(int cls);
+
+/*
+Push the chain first ... last of class cls (linked through
+FREE_LINK(n)->next) on its stack with one CAS
+return 0 (and push nothing) if a payload does not fit in the top
+*/
+int lf_push(int cls, node_t * first, node_t * last);
+
+/*
+malloc for class cls when its stack is empty: carve LF_REFILL blocks of
+the class from arena under its lock, push all but one, return that one
+return NULL if the arena is out of space
+*/
+node_t * lf_refill(arena_t * arena, int cls);
+
+/* Arena Functions */
+
+/*
+Return the arena that owns the block at ptr
+*/
+arena_t * arenaOf(void * ptr);
+
+/*
+Return arena i, creating it (and every arena before it) if needed
+return NULL if the mapping for a new arena fails
+*/
+arena_t * get_arena(int i);
+
+/*
+Return how many arenas exist
+*/
+int get_num_arenas();
+
+/*
+Return the heap memo of arena i in bytes
+*/
+unsigned long get_arena_data_segment_size(int i);
+
+/*
+Return the free space of arena i in bytes:
+usable free space + space occupied by meta-data
+*/
+unsigned long get_arena_data_segment_free_space_size(int i);
+
+/*
+malloc_trim for all arenas: give the free tail of every arena back to
+the OS, keeping pad bytes in each one (after the blocks on its remote
+free stack are freed)
+return 1 if any heap shrank, 0 otherwise
+*/
+int my_malloc_trim(size_t pad);
+
+/*
+Set the size from which a free tail is given back to the OS
+*/
+void set_trim_threshold(size_t bytes);
+
+/*
+Set the size from which a request is served with its own mapping
+*/
+void set_mmap_threshold(size_t bytes);
+
+/*
+Set the smallest chunk the heap grows by, 0 grows by exactly the node
+*/
+void set_heap_chunk(size_t bytes);
+
+/*
+Set how many bytes the quick lists of an arena may hold before they are
+merged (-DDEFERRED)
+*/
+void set_quick_threshold(size_t bytes);
+
+/*
+Set how much a node may waste, in percent of the request, for good fit
+to take it without looking further
+*/
+void set_good_fit_slack(size_t percent);
+
+/*
+Set how many free nodes a good fit search visits at most, 0 makes it
+best fit
+*/
+void set_good_fit_candidates(size_t count);
+
+/*
+Return the bytes currently mapped for large blocks (headers included)
+*/
+unsigned long get_mmapped_size();
+
+/*
+Return how many large blocks are currently mapped
+*/
+unsigned long get_mmapped_count();
+
+/*
+Return the entire heap memo in bytes, summed over all arenas
 */
 
 unsigned long get_data_segment_size();
 
 /*
-Return the free space in the heap:
+Return the free space in the heap, summed over all arenas:
 usable free space + space occupied by meta-data
 */
 unsigned long get_data_segment_free_space_size();
@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+
+#include "my_malloc.h"
+
+/*
+The standard malloc family on top of this allocator, so that it can be
+put under any binary with LD_PRELOAD=libmymalloc_preload.so. It is only
+linked into the preload library: libmymalloc.so keeps the system malloc,
+so the test programs can still compare against it.
+
+The policy is read from MYMALLOC_POLICY on the first call:
+    "ff" - first fit on the main arena, behind the main arena lock
+    "bf" - best fit on the main arena, behind the main arena lock
+    "ts" - ts_malloc/ts_free (the default, real binaries have threads)
+MYMALLOC_MMAP_THRESHOLD and MYMALLOC_TRIM_THRESHOLD set the thresholds,
+MYMALLOC_HEAP_CHUNK the smallest heap growth.
+*/
+
+#define POLICY_FF 0
+#define POLICY_BF 1
+#define POLICY_TS 2
+
+//-1 until the environment has been read
+int libc_policy = -1;
+
+/*
+Read the policy and the thresholds from the environment
+getenv and strtoul do not allocate, so this is safe inside malloc
+*/
+void libc_init() {
+  const char * value = getenv("MYMALLOC_POLICY");
+  int policy = POLICY_TS;
+  if (value != NULL && strcmp(value, "ff") == 0) {
+    policy = POLICY_FF;
+  }
+  else if (value != NULL && strcmp(value, "bf") == 0) {
+    policy = POLICY_BF;
+  }
+
+  value = getenv("MYMALLOC_MMAP_THRESHOLD");
+  if (value != NULL) {
+    set_mmap_threshold(strtoul(value, NULL, 0));
+  }
+  value = getenv("MYMALLOC_TRIM_THRESHOLD");
+  if (value != NULL) {
+    set_trim_threshold(strtoul(value, NULL, 0));
+  }
+  value = getenv("MYMALLOC_HEAP_CHUNK");
+  if (value != NULL) {
+    set_heap_chunk(strtoul(value, NULL, 0));
+  }
+
+  __atomic_store_n(&libc_policy, policy, __ATOMIC_RELEASE);
+}
+
+int get_policy() {
+  int policy = __atomic_load_n(&libc_policy, __ATOMIC_ACQUIRE);
+  if (policy < 0) {
+    libc_init();
+    policy = libc_policy;
+  }
+  return policy;
+}
+
+/*
+A fork() while another thread holds an arena lock would leave that lock
+held forever in the child, so every lock is taken around fork()
+*/
+void libc_prefork() {
+  pthread_mutex_lock(&arenas_lock);
+  for (int i = 0; i < get_num_arenas(); i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+  }
+}
+
+void libc_postfork() {
+  for (int i = get_num_arenas() - 1; i >= 0; i--) {
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  pthread_mutex_unlock(&arenas_lock);
+}
+
+__attribute__((constructor)) void libc_register_fork() {
+  pthread_atfork(libc_prefork, libc_postfork, libc_postfork);
+}
+
+void * malloc(size_t size) {
+  void * ptr;
+  int policy = get_policy();
+
+  if (policy == POLICY_TS) {
+    ptr = ts_malloc(size);
+  }
+  else {
+    pthread_mutex_lock(&arenas[0].lock);
+    ptr = (policy == POLICY_FF) ? ff_malloc(size) : bf_malloc(size);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void free(void * ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (get_policy() == POLICY_TS) {
+    ts_free(ptr);
+  }
+  else {
+    pthread_mutex_lock(&arenas[0].lock);
+    policyFree(ptr);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+}
+
+//C23 free_sized: size is the size ptr was allocated with
+void free_sized(void * ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (get_policy() == POLICY_TS) {
+    ts_free_sized(ptr, size);
+  }
+  else {
+    pthread_mutex_lock(&arenas[0].lock);
+    sized_free(&arenas[0], ptr, size);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+}
+
+//not part of libc: allocate count blocks of size bytes under one lock
+size_t malloc_batch(size_t size, size_t count, void ** out) {
+  size_t done;
+  int policy = get_policy();
+
+  if (policy == POLICY_TS) {
+    done = ts_malloc_batch(size, count, out);
+  }
+  else {
+    pthread_mutex_lock(&arenas[0].lock);
+    done = (policy == POLICY_FF) ? ff_malloc_batch(size, count, out) : bf_malloc_batch(size, count, out);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+  return done;
+}
+
+//not part of libc: free count blocks under one lock, ptrs gets sorted
+void free_batch(void ** ptrs, size_t count) {
+  if (get_policy() == POLICY_TS) {
+    ts_free_batch(ptrs, count);
+  }
+  else {
+    pthread_mutex_lock(&arenas[0].lock);
+    ff_free_batch(ptrs, count);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+}
+
+void * calloc(size_t count, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  void * ptr = malloc(total);
+  if (ptr != NULL) {
+    memset(ptr, 0, total);
+  }
+  return ptr;
+}
+
+//realloc resizes in place when it can, see arena_realloc
+void * realloc(void * ptr, size_t size) {
+  void * new_ptr;
+  int policy = get_policy();
+
+  if (policy == POLICY_TS) {
+    new_ptr = ts_realloc(ptr, size);
+  }
+  else {
+    pthread_mutex_lock(&arenas[0].lock);
+    new_ptr = (policy == POLICY_FF) ? ff_realloc(ptr, size) : bf_realloc(ptr, size);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+
+  if (new_ptr == NULL && size != 0) {
+    errno = ENOMEM;
+  }
+  return new_ptr;
+}
+
+void * memalign(size_t alignment, size_t size) {
+  void * ptr;
+  int policy = get_policy();
+
+  if (alignment & (alignment - 1)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (policy == POLICY_TS) {
+    ptr = ts_memalign(alignment, size);
+  }
+  else {
+    pthread_mutex_lock(&arenas[0].lock);
+    ptr = (policy == POLICY_FF) ? ff_memalign(alignment, size) : bf_memalign(alignment, size);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+    return EINVAL;
+  }
+
+  void * ptr = memalign(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void * aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+void * valloc(size_t size) {
+  return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void * pvalloc(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+//Return how many bytes the block at ptr can hold
+size_t malloc_usable_size(void * ptr) {
+  if (ptr == NULL) {
+    return 0;
+  }
+#ifdef SLAB
+  slab_t * slab = slabOf(ptr);
+  if (slab != NULL) {
+    return slab->size;
+  }
+#endif
+  node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
+  return n->size;
+}
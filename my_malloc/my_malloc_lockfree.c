@@ -0,0 +1,130 @@
+#include "my_malloc.h"
+
+/*
+Lock-free stacks of small blocks for ts_malloc/ts_free (-DLOCKFREE),
+one per tcache class. See my_malloc.h.
+*/
+
+lf_stack_t lf_stacks[TCACHE_CLASSES];
+
+#define LF_ADDRESS_MASK ((1UL << LF_ADDRESS_BITS) - 1)
+
+//Return the top word for node n (or NULL) and tag
+unsigned long lfPack(node_t * n, unsigned long tag) {
+  unsigned long address = (n == NULL) ? 0 : (unsigned long)((char *)n + NODE_SIZE) >> 4;
+  return address | (tag << LF_ADDRESS_BITS);
+}
+
+//Return the node of the top word top, NULL if the stack is empty
+node_t * lfNode(unsigned long top) {
+  unsigned long address = top & LF_ADDRESS_MASK;
+  return (address == 0) ? NULL : (node_t *)((char *)(address << 4) - NODE_SIZE);
+}
+
+//Return the tag after the one in top
+unsigned long lfNextTag(unsigned long top) {
+  return ((top >> LF_ADDRESS_BITS) + 1) & ((1UL << LF_TAG_BITS) - 1);
+}
+
+/*
+Pop a block of tcache class cls from its stack
+1. read the top and the block after it
+2. swing the top to that block with a new tag
+   if another thread changed the top in between, the CAS fails (even
+   when the same block is on top again) and the pop starts over
+return NULL if the stack is empty
+*/
+node_t * lf_pop(int cls) {
+  lf_stack_t * stack = &lf_stacks[cls];
+  unsigned long top = __atomic_load_n(&stack->top, __ATOMIC_ACQUIRE);
+  while (1) {
+    //1. the next block, which may be stale if the top moved already
+    node_t * n = lfNode(top);
+    if (n == NULL) {
+      return NULL;
+    }
+    node_t * next = __atomic_load_n(&FREE_LINK(n)->next, __ATOMIC_RELAXED);
+
+    //2. take n if the top is still what was read
+    if (__atomic_compare_exchange_n(&stack->top, &top, lfPack(next, lfNextTag(top)), 1,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      return n;
+    }
+  }
+}
+
+/*
+Push the chain first ... last of class cls on its stack with one CAS
+(again if another thread changed the top in between)
+return 0 (and push nothing) if a payload does not fit in the top
+*/
+int lf_push(int cls, node_t * first, node_t * last) {
+  for (node_t * n = first;; n = FREE_LINK(n)->next) {
+    if (((unsigned long)((char *)n + NODE_SIZE) >> 4) > LF_ADDRESS_MASK) {
+      return 0;
+    }
+    if (n == last) {
+      break;
+    }
+  }
+
+  lf_stack_t * stack = &lf_stacks[cls];
+  unsigned long top = __atomic_load_n(&stack->top, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(&FREE_LINK(last)->next, lfNode(top), __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&stack->top, &top, lfPack(first, lfNextTag(top)), 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return 1;
+}
+
+/*
+malloc for class cls when its stack is empty:
+1. carve LF_REFILL blocks of the class from arena under its lock
+2. push all but the first on the stack as one chain
+   a block that is bigger than the class (the last block of a node
+   keeps a rest that is too small to split) must not go on the stack,
+   it would go back to the heap when it is freed: it is freed at once
+return the first one, NULL if the arena is out of space
+*/
+node_t * lf_refill(arena_t * arena, int cls) {
+  size_t size = MIN_PAYLOAD + cls * ALIGNMENT;
+  void * blocks[LF_REFILL];
+
+  //1. carve the blocks
+  pthread_mutex_lock(&arena->lock);
+  arena_drain_remote(arena);
+  size_t done = arena_malloc_batch(arena, size, LF_REFILL, blocks, best_fit);
+  pthread_mutex_unlock(&arena->lock);
+  if (done == 0) {
+    return NULL;
+  }
+
+  //2. chain the blocks of exactly this class, keep the others in blocks
+  node_t * first = NULL;
+  node_t * last = NULL;
+  size_t rest = 0;
+  for (size_t i = 1; i < done; i++) {
+    node_t * n = (node_t *)((char *)blocks[i] - NODE_SIZE);
+    if (tcache_class(n->size) != cls) {
+      blocks[1 + rest++] = blocks[i];
+      continue;
+    }
+    if (last == NULL) {
+      last = n;
+    }
+    FREE_LINK(n)->next = first;
+    first = n;
+  }
+  if (first != NULL && !lf_push(cls, first, last)) {
+    for (node_t * n = first; n != NULL; n = (n == last) ? NULL : FREE_LINK(n)->next) {
+      blocks[1 + rest++] = (char *)n + NODE_SIZE;
+    }
+  }
+  if (rest > 0) {
+    sortPointers(blocks + 1, rest);
+    pthread_mutex_lock(&arena->lock);
+    arena_free_batch(arena, blocks + 1, rest);
+    pthread_mutex_unlock(&arena->lock);
+  }
+  return (node_t *)((char *)blocks[0] - NODE_SIZE);
+}
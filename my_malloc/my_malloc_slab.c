@@ -0,0 +1,156 @@
+#include "my_malloc.h"
+
+/*
+Slabs for small requests: equal slots without a header, the size class
+of a slot is found from the address of its slab. See my_malloc.h.
+*/
+
+//the slab region: [slab_base, slab_limit), slabs are carved at slab_brk
+char * slab_base = NULL;
+char * slab_brk = NULL;
+char * slab_limit = NULL;
+
+//slabs with at least one free slot, per size class
+slab_t * slab_partial[SLAB_CLASSES];
+//slabs whose slots are all free
+slab_t * slab_empty = NULL;
+
+/*
+malloc from the slab of the size class of size (at most SLAB_MAX_SIZE)
+1. take the first partial slab of the class, or a new one
+2. hand out a freed slot, or else the next unused one
+3. a slab without free slots leaves the partial list
+*/
+void * slab_malloc(size_t size) {
+  size = (size == 0) ? ALIGNMENT : (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+  int cls = size / ALIGNMENT - 1;
+
+  //1. find a slab of the class
+  slab_t * slab = slab_partial[cls];
+  if (slab == NULL) {
+    slab = slab_new(size);
+    if (slab == NULL) {
+      return NULL;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab_partial[cls] = slab;
+  }
+
+  //2. take a slot
+  void * ptr;
+  if (slab->free != NULL) {
+    ptr = slab->free;
+    slab->free = *(void **)ptr;
+  }
+  else {
+    ptr = slab->unused;
+    slab->unused += size;
+  }
+  slab->used++;
+  arenas[0].free_space -= size;
+  arenas[0].slab_free -= size;
+  arenas[0].used_count++;
+
+  //3. a full slab is not on any list until a slot is freed
+  if (slab->free == NULL && slab->unused + size > (char *)slab + SLAB_SIZE) {
+    slab_partial[cls] = slab->next;
+    if (slab->next != NULL) {
+      slab->next->prev = NULL;
+    }
+  }
+
+  return ptr;
+}
+
+/*
+free a slot:
+1. a full slab goes back on the partial list of its class
+2. the slot is pushed on the free slots of the slab
+3. a slab whose slots are all free moves to the empty list
+*/
+void slab_free(slab_t * slab, void * ptr) {
+  int cls = slab->size / ALIGNMENT - 1;
+
+  //1. the slab was full, so it was on no list
+  if (slab->free == NULL && slab->unused + slab->size > (char *)slab + SLAB_SIZE) {
+    slab->prev = NULL;
+    slab->next = slab_partial[cls];
+    if (slab->next != NULL) {
+      slab->next->prev = slab;
+    }
+    slab_partial[cls] = slab;
+  }
+
+  //2. push the slot
+  *(void **)ptr = slab->free;
+  slab->free = ptr;
+  slab->used--;
+  arenas[0].free_space += slab->size;
+  arenas[0].slab_free += slab->size;
+  arenas[0].used_count--;
+
+  //3. an empty slab can take any class
+  if (slab->used == 0) {
+    if (slab->prev != NULL) {
+      slab->prev->next = slab->next;
+    }
+    else {
+      slab_partial[cls] = slab->next;
+    }
+    if (slab->next != NULL) {
+      slab->next->prev = slab->prev;
+    }
+    slab->next = slab_empty;
+    slab_empty = slab;
+  }
+}
+
+//Return the slab that holds ptr, NULL if ptr is not a slot
+slab_t * slabOf(void * ptr) {
+  if ((char *)ptr < slab_base || (char *)ptr >= slab_brk) {
+    return NULL;
+  }
+  return (slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/*
+Return a slab for slots of size bytes: an empty one if there is one,
+otherwise a new one from the slab region (reserved on the first call)
+return NULL if the region is used up
+*/
+slab_t * slab_new(size_t size) {
+  slab_t * slab = slab_empty;
+  if (slab != NULL) {
+    slab_empty = slab->next;
+  }
+  else {
+    if (slab_base == NULL) {
+      //reserve one more slab, so the region can start on a slab boundary
+      char * start = mmap(NULL, SLAB_RESERVE + SLAB_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (start == MAP_FAILED) {
+        return NULL;
+      }
+      slab_base = (char *)(((uintptr_t)start + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+      slab_brk = slab_base;
+      slab_limit = slab_base + SLAB_RESERVE;
+    }
+    if (slab_brk == slab_limit) {
+      return NULL;
+    }
+    slab = (slab_t *)slab_brk;
+    slab_brk += SLAB_SIZE;
+    //a slab is part of the data segment of the main arena,
+    //its header and the slots that are not handed out are free space
+    arenas[0].heap_size += SLAB_SIZE;
+    arenas[0].free_space += SLAB_SIZE;
+    arenas[0].slab_free += SLAB_SIZE;
+  }
+
+  slab->free = NULL;
+  slab->unused = (char *)slab + SLAB_HEADER;
+  slab->size = size;
+  slab->used = 0;
+  return slab;
+}
@@ -0,0 +1,109 @@
+#include <time.h>
+
+#include "my_malloc.h"
+
+/*
+Statistics of the allocator: latency histograms of malloc and free and
+counters of the work behind them. They are only recorded with -DSTATS,
+see the STAT_ macros in my_malloc.h; this file only stores and reports.
+*/
+
+malloc_stats_t alloc_stats;
+
+//Return CLOCK_MONOTONIC in ns
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//Add the time since start to the latency histogram hist
+void stats_record(unsigned long * hist, uint64_t start) {
+  uint64_t ns = stats_now() - start;
+  //bucket i holds [2^i, 2^(i+1)) ns
+  int bucket = (ns < 2) ? 0 : 63 - __builtin_clzl(ns);
+  if (bucket >= STATS_BUCKETS) {
+    bucket = STATS_BUCKETS - 1;
+  }
+  __atomic_fetch_add(&hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+//Copy the statistics into stats
+void get_malloc_stats(malloc_stats_t * stats) {
+  //a field at a time, other threads may be adding to them
+  unsigned long * from = (unsigned long *)&alloc_stats;
+  unsigned long * to = (unsigned long *)stats;
+  for (size_t i = 0; i < sizeof(malloc_stats_t) / sizeof(unsigned long); i++) {
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+//Set every statistic back to 0
+void reset_malloc_stats() {
+  unsigned long * field = (unsigned long *)&alloc_stats;
+  for (size_t i = 0; i < sizeof(malloc_stats_t) / sizeof(unsigned long); i++) {
+    __atomic_store_n(&field[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+Return the upper bound in ns of the bucket of hist that holds the
+fraction q of the calls
+*/
+unsigned long statsPercentile(const unsigned long * hist, double q) {
+  unsigned long total = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    total += hist[i];
+  }
+
+  unsigned long seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen > 0 && seen >= q * total) {
+      return 2UL << i;
+    }
+  }
+  return 0;
+}
+
+//Print the counters and a summary of both latency histograms to out
+void print_malloc_stats(FILE * out) {
+  malloc_stats_t stats;
+  get_malloc_stats(&stats);
+
+  unsigned long mallocs = 0;
+  unsigned long frees = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    mallocs += stats.malloc_ns[i];
+    frees += stats.free_ns[i];
+  }
+
+  fprintf(out, "malloc: %lu calls, p50 < %lu ns, p99 < %lu ns, p99.9 < %lu ns\n",
+          mallocs,
+          statsPercentile(stats.malloc_ns, 0.5),
+          statsPercentile(stats.malloc_ns, 0.99),
+          statsPercentile(stats.malloc_ns, 0.999));
+  fprintf(out, "free:   %lu calls, p50 < %lu ns, p99 < %lu ns, p99.9 < %lu ns\n",
+          frees,
+          statsPercentile(stats.free_ns, 0.5),
+          statsPercentile(stats.free_ns, 0.99),
+          statsPercentile(stats.free_ns, 0.999));
+  fprintf(out, "searches = %lu, nodes visited = %lu (%.1f per search)\n",
+          stats.searches,
+          stats.nodes_visited,
+          stats.searches ? (double)stats.nodes_visited / stats.searches : 0.0);
+  fprintf(out, "splits = %lu, merges = %lu, sbrk calls = %lu\n",
+          stats.splits,
+          stats.merges,
+          stats.sbrk_calls);
+}
+
+#ifdef STATS
+void stats_dump() {
+  print_malloc_stats(stderr);
+}
+
+__attribute__((constructor)) void stats_register_dump() {
+  atexit(stats_dump);
+}
+#endif
@@ -0,0 +1,379 @@
+#include "my_malloc.h"
+
+/*
+Thread safe malloc/free: the best fit heap of my_malloc.c, one arena
+per core and a lock per arena, with a per-thread cache of small blocks
+in front of it, so the common case does not take a lock at all.
+*/
+
+//the arena of this thread, assigned on its first malloc
+__thread arena_t * thread_arena = NULL;
+//round robin counter that spreads the threads over the arenas
+int next_arena = 0;
+
+//every thread has its own cache
+__thread tcache_t tcache;
+
+//the key only exists to run tcache_flush when a thread exits
+pthread_key_t tcache_key;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+void tcache_make_key() {
+  pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/*
+Thread safe malloc:
+1. a block of exactly the right size in the thread cache is returned
+   without touching the heap
+   (with -DLOCKFREE, then one from the lock-free stack of its class,
+   which is refilled from the arena when it is empty)
+2. otherwise best fit runs on the arena of the thread under its lock,
+   after the blocks on its remote free stack are freed
+   if that arena is out of space, the main arena is tried as well
+*/
+void * ts_malloc(size_t size) {
+  //rounding up a size near SIZE_MAX would wrap around to a small one
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  size = adjust_size(size);
+
+  //1. check the thread cache
+  int cls = tcache_class(size);
+  if (cls >= 0 && tcache.blocks[cls] != NULL) {
+    node_t * n = tcache.blocks[cls];
+    tcache.blocks[cls] = FREE_LINK(n)->next;
+    tcache.count[cls]--;
+    return (void *)((char *)n + NODE_SIZE);
+  }
+#ifdef LOCKFREE
+  //a large block may be mmapped if the threshold is that low
+  if (cls >= 0 && size < mmap_threshold) {
+    node_t * n = lf_pop(cls);
+    if (n == NULL) {
+      n = lf_refill(get_thread_arena(), cls);
+    }
+    if (n != NULL) {
+      return (void *)((char *)n + NODE_SIZE);
+    }
+  }
+#endif
+
+  //2. go to the arena of this thread, with what other threads freed to it
+  arena_t * arena = get_thread_arena();
+  pthread_mutex_lock(&arena->lock);
+  arena_drain_remote(arena);
+  void * address = arena_malloc(arena, size, best_fit);
+  pthread_mutex_unlock(&arena->lock);
+
+  if (address == NULL && arena != &arenas[0]) {
+    pthread_mutex_lock(&arenas[0].lock);
+    arena_drain_remote(&arenas[0]);
+    address = arena_malloc(&arenas[0], size, best_fit);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+  return address;
+}
+
+/*
+Thread safe memalign: aligned blocks are rare, so they skip the thread
+cache and go to the arena of the thread under its lock
+*/
+void * ts_memalign(size_t alignment, size_t size) {
+  arena_t * arena = get_thread_arena();
+  pthread_mutex_lock(&arena->lock);
+  arena_drain_remote(arena);
+  void * address = arena_memalign(arena, alignment, size, best_fit_aligned);
+  pthread_mutex_unlock(&arena->lock);
+  return address;
+}
+
+/*
+Thread safe realloc: the node is resized under the lock of the arena
+that owns it, a large block moves to the arena of this thread
+(with -DLOCKFREE a small block never goes back to the heap: it stays
+put if it is big enough, else it is copied and freed to its stack)
+*/
+void * ts_realloc(void * ptr, size_t size) {
+  if (ptr == NULL) {
+    return ts_malloc(size);
+  }
+  if (size == 0) {
+    ts_free(ptr);
+    return NULL;
+  }
+
+  node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
+#ifdef LOCKFREE
+  if (!n->mmapped && tcache_class(n->size) >= 0) {
+    if (size <= n->size) {
+      return ptr;
+    }
+    void * new_ptr = ts_malloc(size);
+    if (new_ptr != NULL) {
+      memcpy(new_ptr, ptr, n->size);
+      ts_free(ptr);
+    }
+    return new_ptr;
+  }
+#endif
+  arena_t * arena = n->mmapped ? get_thread_arena() : arenaOf(ptr);
+  pthread_mutex_lock(&arena->lock);
+  void * address = arena_realloc(arena, ptr, size, best_fit);
+  pthread_mutex_unlock(&arena->lock);
+  return address;
+}
+
+/*
+Thread safe free:
+1. a small block goes to the thread cache while the cache has room
+   (with -DLOCKFREE, else onto the lock-free stack of its class)
+2. otherwise it is freed to the arena that owns it: under its lock if
+   that is the arena of this thread, else onto its remote free stack
+*/
+void ts_free(void * ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
+  if (n->mmapped) {
+    //a large block has no arena, and needs no lock
+    mmap_free(n);
+    return;
+  }
+
+  //1. keep it in the thread cache, it stays used in the heap
+  int cls = tcache_class(n->size);
+  if (cls >= 0 && tcache.count[cls] < TCACHE_MAX_COUNT) {
+    if (tcache.count[cls] == 0) {
+      //make sure the cache is flushed when this thread exits
+      pthread_once(&tcache_key_once, tcache_make_key);
+      pthread_setspecific(tcache_key, &tcache);
+    }
+    FREE_LINK(n)->next = tcache.blocks[cls];
+    tcache.blocks[cls] = n;
+    tcache.count[cls]++;
+    return;
+  }
+#ifdef LOCKFREE
+  if (cls >= 0 && lf_push(cls, n, n)) {
+    return;
+  }
+#endif
+
+  //2. give it back to its arena
+  arena_t * arena = arenaOf(ptr);
+  if (arena != thread_arena) {
+    remote_free(arena, n, n);
+    return;
+  }
+  pthread_mutex_lock(&arena->lock);
+  my_free(arena, ptr);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+Thread safe free with the size that was asked for: the thread cache
+class comes from size, so a cached block is pushed without reading its
+header. A cached block may be bigger than its class, which only wastes
+the difference until it is flushed.
+*/
+void ts_free_sized(void * ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+#ifdef CHECK_SIZE
+  check_size(ptr, size);
+#endif
+
+  int cls = tcache_class(adjust_size(size));
+  if (cls >= 0 && tcache.count[cls] > 0 && tcache.count[cls] < TCACHE_MAX_COUNT) {
+    //(the first block of a class takes the slow path, which sets up the flush)
+    node_t * n = (node_t *)((char *)ptr - NODE_SIZE);
+    FREE_LINK(n)->next = tcache.blocks[cls];
+    tcache.blocks[cls] = n;
+    tcache.count[cls]++;
+    return;
+  }
+  ts_free(ptr);
+}
+
+/*
+Thread safe malloc_batch: the whole batch is allocated on the arena of
+the thread under one lock, the main arena gets what is left
+*/
+size_t ts_malloc_batch(size_t size, size_t count, void ** out) {
+  arena_t * arena = get_thread_arena();
+  pthread_mutex_lock(&arena->lock);
+  arena_drain_remote(arena);
+  size_t done = arena_malloc_batch(arena, size, count, out, best_fit);
+  pthread_mutex_unlock(&arena->lock);
+
+  if (done < count && arena != &arenas[0]) {
+    pthread_mutex_lock(&arenas[0].lock);
+    arena_drain_remote(&arenas[0]);
+    done += arena_malloc_batch(&arenas[0], size, count - done, out + done, best_fit);
+    pthread_mutex_unlock(&arenas[0].lock);
+  }
+  return done;
+}
+
+/*
+Thread safe free_batch: after sorting, the blocks of one arena are next
+to each other, so every arena is locked once for all its blocks, and
+the blocks of another thread's arena go onto its remote free stack with
+one push (with -DLOCKFREE the small blocks are taken out first and go
+through ts_free, so they end up on their stacks)
+*/
+void ts_free_batch(void ** ptrs, size_t count) {
+#ifdef LOCKFREE
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (ptrs[i] != NULL) {
+      node_t * n = (node_t *)((char *)ptrs[i] - NODE_SIZE);
+      if (!n->mmapped && tcache_class(n->size) >= 0) {
+        ts_free(ptrs[i]);
+        continue;
+      }
+    }
+    ptrs[kept++] = ptrs[i];
+  }
+  count = kept;
+#endif
+  sortPointers(ptrs, count);
+
+  size_t i = 0;
+  while (i < count) {
+    arena_t * arena = arenaOf(ptrs[i]);
+    size_t j = i + 1;
+    while (j < count && arenaOf(ptrs[j]) == arena) {
+      j++;
+    }
+    if (arena != thread_arena) {
+      remoteFreeBatch(arena, ptrs + i, j - i);
+      i = j;
+      continue;
+    }
+    pthread_mutex_lock(&arena->lock);
+    arena_free_batch(arena, ptrs + i, j - i);
+    pthread_mutex_unlock(&arena->lock);
+    i = j;
+  }
+}
+
+/*
+Push the chain first ... last of freed blocks of arena on its remote
+free stack with one CAS (again if another thread pushed in between)
+*/
+void remote_free(arena_t * arena, node_t * first, node_t * last) {
+  node_t * head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+  do {
+    FREE_LINK(last)->next = head;
+  } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+Link the count blocks of ptrs (all of arena) into a chain and push it
+with a single remote_free, a large block is unmapped right away
+*/
+void remoteFreeBatch(arena_t * arena, void ** ptrs, size_t count) {
+  node_t * first = NULL;
+  node_t * last = NULL;
+  for (size_t i = 0; i < count; i++) {
+    if (ptrs[i] == NULL) {
+      continue;
+    }
+    node_t * n = (node_t *)((char *)ptrs[i] - NODE_SIZE);
+    if (n->mmapped) {
+      mmap_free(n);
+      continue;
+    }
+    if (last == NULL) {
+      last = n;
+    }
+    FREE_LINK(n)->next = first;
+    first = n;
+  }
+  if (first != NULL) {
+    remote_free(arena, first, last);
+  }
+}
+
+/*
+Free every block on the remote free stack of arena (the caller holds the
+lock): the stack is taken with one exchange, and its blocks are freed
+REMOTE_DRAIN_BATCH at a time, sorted, so neighbours are merged at once
+*/
+void arena_drain_remote(arena_t * arena) {
+  if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+  node_t * n = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+  void * ptrs[REMOTE_DRAIN_BATCH];
+  while (n != NULL) {
+    size_t count = 0;
+    while (n != NULL && count < REMOTE_DRAIN_BATCH) {
+      ptrs[count++] = (char *)n + NODE_SIZE;
+      n = FREE_LINK(n)->next;
+    }
+    sortPointers(ptrs, count);
+    arena_free_batch(arena, ptrs, count);
+  }
+}
+
+/*
+Return the arena of the calling thread, assigning one round robin on
+the first call. There is one arena per online core, at most MAX_ARENAS.
+*/
+arena_t * get_thread_arena() {
+  if (thread_arena == NULL) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = (cores < 1) ? 1 : (cores > MAX_ARENAS) ? MAX_ARENAS : (int)cores;
+    int i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % count;
+
+    thread_arena = get_arena(i);
+    if (thread_arena == NULL) {
+      //no address space for a new arena, share the main one
+      thread_arena = &arenas[0];
+    }
+  }
+  return thread_arena;
+}
+
+//Return the tcache class of a block with size bytes of payload
+int tcache_class(size_t size) {
+  if (size > TCACHE_MAX_SIZE) {
+    return -1;
+  }
+  return (size - MIN_PAYLOAD) / ALIGNMENT;
+}
+
+/*
+Gives every block of an exiting thread's cache back to its arena
+(with -DLOCKFREE, a small block goes onto the stack of the class of
+its header: ts_free_sized may have cached it under a smaller class)
+*/
+void tcache_flush(void * cache) {
+  tcache_t * tc = cache;
+
+  for (int i = 0; i < TCACHE_CLASSES; i++) {
+    while (tc->blocks[i] != NULL) {
+      node_t * n = tc->blocks[i];
+      tc->blocks[i] = FREE_LINK(n)->next;
+#ifdef LOCKFREE
+      int cls = tcache_class(n->size);
+      if (!n->mmapped && cls >= 0 && lf_push(cls, n, n)) {
+        continue;
+      }
+#endif
+
+      arena_t * arena = arenaOf(n);
+      pthread_mutex_lock(&arena->lock);
+      my_free(arena, (char *)n + NODE_SIZE);
+      pthread_mutex_unlock(&arena->lock);
+    }
+    tc->count[i] = 0;
+  }
+}
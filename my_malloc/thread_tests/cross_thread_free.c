@@ -0,0 +1,90 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "thread_bench.h"
+
+#define NUM_ROUNDS 2000
+#define BATCH_SIZE 64
+#define MIN_SIZE 64
+#define MAX_SIZE 4096
+
+/*
+The threads stand in a ring. Each round a thread mallocs a batch of
+BATCH_SIZE blocks of MIN_SIZE - MAX_SIZE bytes (a burst of network
+buffers, say) and hands it to the next thread, which frees it: every
+block is freed by a thread that did not malloc it. With one thread the
+ring is that thread alone, and it frees its own blocks.
+
+A mailbox holds one batch. A thread whose next mailbox is still full
+empties its own mailbox while it waits, so the ring never locks up.
+*/
+
+typedef struct batch_tag {
+  //written by bench_malloc
+  size_t size;
+  int count;
+  void * blocks[BATCH_SIZE];
+} batch_t;
+
+//the batch waiting for thread i, or NULL
+batch_t * mailboxes[MAX_THREADS];
+int ring_size;
+//threads that have handed off their last batch
+int finished;
+
+//Free the batch in the mailbox of thread id, if there is one
+void drain(int id) {
+  batch_t * b = __atomic_exchange_n(&mailboxes[id], NULL, __ATOMIC_ACQUIRE);
+  if (b == NULL) {
+    return;
+  }
+  for (int i = 0; i < b->count; i++) {
+    bench_free(id, b->blocks[i]);
+  }
+  bench_free(id, b);
+}
+
+void * worker(void * arg) {
+  int id = (int)(long)arg;
+  int next = (id + 1) % ring_size;
+  unsigned seed = id + 1;
+
+  for (int r = 0; r < NUM_ROUNDS; r++) {
+    batch_t * b = bench_malloc(id, sizeof(batch_t));
+    b->count = BATCH_SIZE;
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      size_t size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE + 1);
+      b->blocks[i] = bench_malloc(id, size);
+    }
+
+    batch_t * empty = NULL;
+    while (!__atomic_compare_exchange_n(&mailboxes[next], &empty, b, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      empty = NULL;
+      drain(id);
+      sched_yield();
+    }
+    drain(id);
+  }
+
+  //the thread before may still hand over a batch
+  __atomic_fetch_add(&finished, 1, __ATOMIC_ACQ_REL);
+  while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < ring_size) {
+    drain(id);
+    sched_yield();
+  }
+  drain(id);
+  return NULL;
+}
+
+void run(int n) {
+  ring_size = n;
+  start_threads(n, worker);
+  wait_threads();
+}
+
+int main(int argc, char * argv[]) {
+  int max_threads = (argc > 1) ? atoi(argv[1]) : 64;
+  benchmark(1, max_threads, run);
+  return 0;
+}
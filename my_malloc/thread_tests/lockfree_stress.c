@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "thread_bench.h"
+
+#define NUM_ROUNDS 2000
+#define BURST_SIZE 256
+#define NUM_SLOTS 1024
+#define MIN_SIZE 16
+#define MAX_SIZE 128
+//one block in TOP_SHARE is of the top classes instead
+#define TOP_SHARE 4
+#define TOP_MIN_SIZE 480
+#define TOP_MAX_SIZE 512
+//holes of HOLE_MIN_SIZE - HOLE_MAX_SIZE bytes between guard blocks
+#define NUM_HOLES 8
+#define HOLE_MIN_SIZE 513
+#define HOLE_MAX_SIZE 544
+#define GUARD_SIZE 1024
+//every TRIM_ROUNDS rounds a thread trims the heap (ts_malloc only)
+#define TRIM_ROUNDS 64
+
+/*
+A correctness test for the lock-free classes (make LOCKFREE=1) under
+heavy contention. Each round a thread mallocs a burst of BURST_SIZE
+blocks of MIN_SIZE - MAX_SIZE bytes, a few size classes only, so its
+thread cache overflows and most blocks go through the shared stacks.
+One block in TOP_SHARE is of the top classes (TOP_MIN_SIZE -
+TOP_MAX_SIZE bytes) instead, and before its burst the thread leaves
+NUM_HOLES free holes a little bigger than the top classes between
+guard blocks. A refill of a top class carves such a hole into a block
+that is bigger than its class, which must not go on a stack: freed,
+it would go back to the heap while a stale pop may still read it. The
+threads trim the heap now and then, so such a block may be unmapped.
+Every block is stamped all over with its thread and its number. Then
+the thread swaps half of the burst into random slots of a shared pool,
+frees what it got out of them (blocks of other threads) and frees the
+other half itself; every block is checked before it is freed.
+
+Two threads that pop the same block, or a block whose links were
+overwritten while it was in use, leave a wrong stamp behind, and the
+test prints CORRUPT and fails (a pop of unmapped memory crashes it).
+At the end every block left on a stack must be of the class of its
+stack, or the test fails as well.
+*/
+
+void * slots[NUM_SLOTS];
+
+//Stamp the block p of size bytes (after the size bench_malloc put first)
+void stamp(size_t * p, size_t size, unsigned long mark) {
+  for (size_t i = 1; i < size / sizeof(size_t); i++) {
+    p[i] = mark ^ i;
+  }
+}
+
+//Check the stamp of the block p, exit if it is broken
+void check(size_t * p) {
+  size_t size = p[0];
+  if (size < MIN_SIZE || size > TOP_MAX_SIZE) {
+    fprintf(stderr, "CORRUPT: block %p has size %zu\n", (void *)p, size);
+    exit(EXIT_FAILURE);
+  }
+  unsigned long mark = p[1] ^ 1;
+  for (size_t i = 2; i < size / sizeof(size_t); i++) {
+    if (p[i] != (mark ^ i)) {
+      fprintf(stderr, "CORRUPT: block %p word %zu is %lx, not %lx\n",
+              (void *)p, i, (unsigned long)p[i], mark ^ i);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void * worker(void * arg) {
+  int id = (int)(long)arg;
+  unsigned seed = id + 1;
+  size_t * burst[BURST_SIZE];
+  unsigned long count = 0;
+
+  for (int r = 0; r < NUM_ROUNDS; r++) {
+    //free holes that do not split into top class blocks
+    void * holes[NUM_HOLES];
+    void * guards[NUM_HOLES];
+    for (int i = 0; i < NUM_HOLES; i++) {
+      holes[i] = bench_malloc(id, HOLE_MIN_SIZE + rand_r(&seed) % (HOLE_MAX_SIZE - HOLE_MIN_SIZE + 1));
+      guards[i] = bench_malloc(id, GUARD_SIZE);
+    }
+    for (int i = 0; i < NUM_HOLES; i++) {
+      bench_free(id, holes[i]);
+    }
+
+    for (int i = 0; i < BURST_SIZE; i++) {
+      size_t size;
+      if (rand_r(&seed) % TOP_SHARE == 0) {
+        size = TOP_MIN_SIZE + rand_r(&seed) % (TOP_MAX_SIZE - TOP_MIN_SIZE + 1);
+      }
+      else {
+        size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE + 1);
+      }
+      burst[i] = bench_malloc(id, size);
+      stamp(burst[i], size, ((unsigned long)id << 40) | count++);
+    }
+
+    //hand half of the burst to other threads
+    for (int i = 0; i < BURST_SIZE / 2; i++) {
+      int k = rand_r(&seed) % NUM_SLOTS;
+      size_t * p = __atomic_exchange_n(&slots[k], burst[i], __ATOMIC_ACQ_REL);
+      if (p != NULL) {
+        check(p);
+        bench_free(id, p);
+      }
+    }
+    for (int i = BURST_SIZE / 2; i < BURST_SIZE; i++) {
+      check(burst[i]);
+      bench_free(id, burst[i]);
+    }
+    for (int i = 0; i < NUM_HOLES; i++) {
+      bench_free(id, guards[i]);
+    }
+#ifdef TS
+    if (r % TRIM_ROUNDS == TRIM_ROUNDS - 1) {
+      my_malloc_trim(0);
+    }
+#endif
+  }
+  return NULL;
+}
+
+#ifdef TS
+/*
+Check that every block on a lock-free stack is of the class of its
+stack: a bigger one would go back to the heap once it is freed
+*/
+void check_stacks() {
+  for (int cls = 0; cls < TCACHE_CLASSES; cls++) {
+    node_t * first = NULL;
+    node_t * last = NULL;
+    node_t * n;
+    while ((n = lf_pop(cls)) != NULL) {
+      if (tcache_class(n->size) != cls) {
+        fprintf(stderr, "CORRUPT: block of %zu bytes on the stack of class %d\n", (size_t)n->size, cls);
+        exit(EXIT_FAILURE);
+      }
+      if (last == NULL) {
+        last = n;
+      }
+      FREE_LINK(n)->next = first;
+      first = n;
+    }
+    if (first != NULL) {
+      lf_push(cls, first, last);
+    }
+  }
+}
+#endif
+
+void run(int n) {
+  start_threads(n, worker);
+  wait_threads();
+  for (int k = 0; k < NUM_SLOTS; k++) {
+    if (slots[k] != NULL) {
+      check(slots[k]);
+      bench_free(MAIN_THREAD, slots[k]);
+    }
+  }
+#ifdef TS
+  check_stacks();
+#endif
+}
+
+int main(int argc, char * argv[]) {
+  int max_threads = (argc > 1) ? atoi(argv[1]) : 64;
+  benchmark(1, max_threads, run);
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_bench.h"
+
+#define NUM_ITEMS 100000
+#define QUEUE_SIZE 1024
+#define MIN_SIZE 64
+#define MAX_SIZE 16384
+
+/*
+n/2 producers and n/2 consumers share one bounded queue. A producer
+mallocs a buffer of MIN_SIZE - MAX_SIZE bytes, fills its first bytes
+and queues it; a consumer takes the next buffer, reads it and frees it.
+This is a pool of workers that frees what a network thread received:
+the buffers are malloc'ed on some threads and always freed on others,
+and up to QUEUE_SIZE of them are in flight.
+*/
+
+void * queue[QUEUE_SIZE];
+int head = 0;
+int tail = 0;
+int queued = 0;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+
+//every producer makes NUM_ITEMS buffers, the consumers take them in turn
+long total;
+long taken = 0;
+
+void * producer(void * arg) {
+  int id = (int)(long)arg;
+  unsigned seed = id + 1;
+
+  for (int i = 0; i < NUM_ITEMS; i++) {
+    size_t size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE + 1);
+    char * buf = bench_malloc(id, size);
+    memset(buf + sizeof(size_t), id, MIN_SIZE - sizeof(size_t));
+
+    pthread_mutex_lock(&queue_lock);
+    while (queued == QUEUE_SIZE) {
+      pthread_cond_wait(&not_full, &queue_lock);
+    }
+    queue[tail] = buf;
+    tail = (tail + 1) % QUEUE_SIZE;
+    queued++;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&queue_lock);
+  }
+  return NULL;
+}
+
+void * consumer(void * arg) {
+  int id = (int)(long)arg;
+  long sum = 0;
+
+  while (__atomic_fetch_add(&taken, 1, __ATOMIC_RELAXED) < total) {
+    pthread_mutex_lock(&queue_lock);
+    while (queued == 0) {
+      pthread_cond_wait(&not_empty, &queue_lock);
+    }
+    char * buf = queue[head];
+    head = (head + 1) % QUEUE_SIZE;
+    queued--;
+    pthread_cond_signal(&not_full);
+    pthread_mutex_unlock(&queue_lock);
+
+    sum += buf[sizeof(size_t)];
+    bench_free(id, buf);
+  }
+  return (void *)sum;
+}
+
+void run(int n) {
+  int producers = n / 2;
+  total = (long)producers * NUM_ITEMS;
+  start_threads(producers, producer);
+  start_threads(n - producers, consumer);
+  wait_threads();
+}
+
+int main(int argc, char * argv[]) {
+  int max_threads = (argc > 1) ? atoi(argv[1]) : 64;
+  //a producer and a consumer at least
+  benchmark(2, max_threads, run);
+  return 0;
+}
@@ -0,0 +1,185 @@
+#include "thread_bench.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+thread_count_t thread_counts[MAX_THREADS + 1];
+
+pthread_t threads[MAX_THREADS];
+int num_threads = 0;
+//workers that have not returned yet
+int running = 0;
+
+//what the samples have seen in this process
+long peak_live = 0;
+long peak_rss = 0;
+
+double calc_time(struct timespec start, struct timespec end) {
+  double start_sec = (double)start.tv_sec * 1000000000.0 + (double)start.tv_nsec;
+  double end_sec = (double)end.tv_sec * 1000000000.0 + (double)end.tv_nsec;
+
+  if (end_sec < start_sec) {
+    return 0;
+  }
+  else {
+    return end_sec - start_sec;
+  }
+};
+
+void * bench_malloc(int id, size_t size) {
+  size_t * p = MALLOC(size);
+  *p = size;
+  thread_count_t * c = &thread_counts[id];
+  __atomic_store_n(&c->bytes, c->bytes + (long)size, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->ops, c->ops + 1, __ATOMIC_RELAXED);
+  return p;
+}
+
+void bench_free(int id, void * ptr) {
+  size_t size = *(size_t *)ptr;
+  FREE(ptr);
+  thread_count_t * c = &thread_counts[id];
+  __atomic_store_n(&c->bytes, c->bytes - (long)size, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->ops, c->ops + 1, __ATOMIC_RELAXED);
+}
+
+//Return the resident set size of this process in bytes
+long rss() {
+  //no fopen: its buffer would be malloc'ed by the allocator under test (LIBC)
+  char buf[128];
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return 0;
+  }
+  buf[n] = '\0';
+  long size, resident;
+  if (sscanf(buf, "%ld %ld", &size, &resident) != 2) {
+    return 0;
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+//Add up the live bytes of all threads, and update the peaks
+void sample() {
+  long live = 0;
+  for (int i = 0; i <= MAX_THREADS; i++) {
+    live += __atomic_load_n(&thread_counts[i].bytes, __ATOMIC_RELAXED);
+  }
+  if (live > peak_live) {
+    peak_live = live;
+  }
+  long r = rss();
+  if (r > peak_rss) {
+    peak_rss = r;
+  }
+}
+
+typedef struct start_tag {
+  void * (*worker)(void *);
+  long id;
+} start_t;
+
+start_t starts[MAX_THREADS];
+
+//Run the worker, then tell wait_threads it is done
+void * trampoline(void * arg) {
+  start_t * s = arg;
+  s->worker((void *)s->id);
+  __atomic_fetch_sub(&running, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void start_threads(int count, void * (*worker)(void *)) {
+  for (int i = 0; i < count && num_threads < MAX_THREADS; i++) {
+    start_t * s = &starts[num_threads];
+    s->worker = worker;
+    s->id = num_threads;
+    __atomic_fetch_add(&running, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&threads[num_threads], NULL, trampoline, s) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    num_threads++;
+  }
+}
+
+void wait_threads() {
+  struct timespec ms = {0, 1000000};
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0) {
+    sample();
+    nanosleep(&ms, NULL);
+  }
+  sample();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+//Run run(n) in this (new) process and print its line
+void runOnce(int n, void (*run)(int n)) {
+  struct timespec start_time, end_time;
+  long base_rss = rss();
+
+  //Start Time
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  run(n);
+
+  //Stop Time
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+  long ops = 0;
+  for (int i = 0; i <= MAX_THREADS; i++) {
+    ops += thread_counts[i].ops;
+  }
+  double elapsed_ns = calc_time(start_time, end_time);
+  printf("Threads = %2d, Execution Time = %f seconds, Throughput = %.0f ops/sec, "
+         "RSS Growth = %ld KB, Peak Live = %ld KB, Blowup = %.2f\n",
+         num_threads,
+         elapsed_ns / 1e9,
+         (double)ops / (elapsed_ns / 1e9),
+         (peak_rss - base_rss) / 1024,
+         peak_live / 1024,
+         peak_live ? (double)(peak_rss - base_rss) / (double)peak_live : 0);
+  fflush(stdout);
+}
+
+void benchmark(int min_threads, int max_threads, void (*run)(int n)) {
+  if (max_threads > MAX_THREADS) {
+    max_threads = MAX_THREADS;
+  }
+  for (int n = min_threads; n <= max_threads; n *= 2) {
+    //a new process for every thread count, so that no run starts with
+    //the heap of the one before
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      runOnce(n, run);
+      _exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Threads = %d: failed (status %d)\n", n, status);
+      exit(EXIT_FAILURE);
+    }
+
+    if (n < max_threads && n * 2 > max_threads) {
+      //always finish with max_threads
+      n = max_threads / 2;
+    }
+  }
+}
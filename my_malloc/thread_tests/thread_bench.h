@@ -0,0 +1,74 @@
+/*
+Shared by the multithreaded benchmarks (cross_thread_free,
+producer_consumer, thread_churn): the MALLOC/FREE of the allocator
+under test, and a driver that runs a benchmark at 1, 2, 4, ... threads,
+each thread count in a new process, and prints its throughput and its
+RSS against the bytes the program really had allocated.
+
+Every block starts with its size, so whichever thread frees it knows
+how many bytes went away. Each thread keeps its own count of bytes
+malloc'ed minus bytes freed (and of ops) in a cache line of its own;
+the main thread adds them up every millisecond, along with the RSS,
+while the workers run.
+*/
+#include <pthread.h>
+#include <stddef.h>
+
+#include "my_malloc.h"
+
+#ifdef TS
+#define MALLOC(sz) ts_malloc(sz)
+#define FREE(p) ts_free(p)
+#endif
+#ifdef LIBC
+#define MALLOC(sz) malloc(sz)
+#define FREE(p) free(p)
+#endif
+
+#define MAX_THREADS 256
+//the main thread counts its own frees here
+#define MAIN_THREAD MAX_THREADS
+
+//what one thread has done, written by that thread only
+typedef struct thread_count_tag {
+  long bytes;
+  long ops;
+} __attribute__((aligned(64))) thread_count_t;
+
+extern thread_count_t thread_counts[MAX_THREADS + 1];
+
+double calc_time(struct timespec start, struct timespec end);
+
+/*
+MALLOC a block of size bytes (at least sizeof(size_t)) for thread id,
+with its size in front
+*/
+void * bench_malloc(int id, size_t size);
+
+//FREE a block of bench_malloc on thread id
+void bench_free(int id, void * ptr);
+
+/*
+Start count threads running worker, each with its own id (a thread
+number, counted up from 0 over all calls) as the argument
+*/
+void start_threads(int count, void * (*worker)(void *));
+
+/*
+Wait for every thread started by start_threads, sampling the live bytes
+and the RSS while they run
+*/
+void wait_threads();
+
+/*
+For n = min_threads, 2 * min_threads, ... up to max_threads (the last
+one always max_threads), run(n) in a new process and print one line:
+
+Threads = n, Execution Time = X seconds, Throughput = X ops/sec, RSS Growth = X KB, Peak Live = X KB, Blowup = X
+
+run must start its threads with start_threads and end with wait_threads.
+Throughput counts every malloc and free. RSS Growth is the largest RSS
+seen over the run minus the RSS before it, and Blowup is RSS Growth
+divided by the most bytes that were live at once.
+*/
+void benchmark(int min_threads, int max_threads, void (*run)(int n));
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "thread_bench.h"
+
+#define NUM_OPS 500000
+#define NUM_SLOTS 4096
+#define MIN_SIZE 16
+#define MAX_SIZE 1024
+
+/*
+All threads churn one shared pool of NUM_SLOTS slots. Each op takes
+the block out of a random slot and frees it, or, if the slot is empty,
+puts a new block of MIN_SIZE - MAX_SIZE bytes there. A block is freed
+by whichever thread comes to its slot next, so with n threads only one
+free in n is done by the thread that malloc'ed the block, and every
+thread mallocs and frees at the same time.
+*/
+
+void * slots[NUM_SLOTS];
+
+void * worker(void * arg) {
+  int id = (int)(long)arg;
+  unsigned seed = id + 1;
+
+  for (int i = 0; i < NUM_OPS; i++) {
+    int k = rand_r(&seed) % NUM_SLOTS;
+    void * p = __atomic_exchange_n(&slots[k], NULL, __ATOMIC_ACQ_REL);
+    if (p != NULL) {
+      bench_free(id, p);
+    }
+    else {
+      size_t size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE + 1);
+      p = bench_malloc(id, size);
+      //another thread may have filled the slot in the meantime
+      p = __atomic_exchange_n(&slots[k], p, __ATOMIC_ACQ_REL);
+      if (p != NULL) {
+        bench_free(id, p);
+      }
+    }
+  }
+  return NULL;
+}
+
+void run(int n) {
+  start_threads(n, worker);
+  wait_threads();
+  for (int k = 0; k < NUM_SLOTS; k++) {
+    if (slots[k] != NULL) {
+      bench_free(MAIN_THREAD, slots[k]);
+    }
+  }
+}
+
+int main(int argc, char * argv[]) {
+  int max_threads = (argc > 1) ? atoi(argv[1]) : 64;
+  benchmark(1, max_threads, run);
+  return 0;
+}
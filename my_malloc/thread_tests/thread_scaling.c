@@ -0,0 +1,104 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "my_malloc.h"
+
+#define NUM_OPS 2000000
+#define NUM_SLOTS 1000
+#define MIN_SIZE 16
+#define MAX_SIZE 512
+
+#ifdef TS
+#define MALLOC(sz) ts_malloc(sz)
+#define FREE(p) ts_free(p)
+#endif
+#ifdef LIBC
+#define MALLOC(sz) malloc(sz)
+#define FREE(p) free(p)
+#endif
+
+double calc_time(struct timespec start, struct timespec end) {
+  double start_sec = (double)start.tv_sec * 1000000000.0 + (double)start.tv_nsec;
+  double end_sec = (double)end.tv_sec * 1000000000.0 + (double)end.tv_nsec;
+
+  if (end_sec < start_sec) {
+    return 0;
+  }
+  else {
+    return end_sec - start_sec;
+  }
+};
+
+/*
+Every thread owns NUM_SLOTS slots. Each op picks a random slot: a full
+slot is freed, an empty one gets a new block of a random size. The
+threads never share blocks, so this measures how the allocator scales
+when nothing but the allocator itself is shared.
+*/
+void * worker(void * arg) {
+  unsigned seed = (unsigned)(unsigned long)arg;
+  char * slots[NUM_SLOTS] = {NULL};
+  int i;
+
+  for (i = 0; i < NUM_OPS; i++) {
+    int k = rand_r(&seed) % NUM_SLOTS;
+    if (slots[k] != NULL) {
+      FREE(slots[k]);
+      slots[k] = NULL;
+    }
+    else {
+      size_t size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE + 1);
+      slots[k] = MALLOC(size);
+      slots[k][0] = (char)k;
+    }
+  }
+
+  for (i = 0; i < NUM_SLOTS; i++) {
+    FREE(slots[i]);
+  }
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  int max_threads = (argc > 1) ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t threads[max_threads];
+  struct timespec start_time, end_time;
+  double base = 0;
+  int n, i;
+
+  for (n = 1; n <= max_threads; n *= 2) {
+    //Start Time
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (i = 0; i < n; i++) {
+      pthread_create(&threads[i], NULL, worker, (void *)(unsigned long)(i + 1));
+    }
+    for (i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+
+    //Stop Time
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    double elapsed_ns = calc_time(start_time, end_time);
+    double throughput = (double)n * NUM_OPS / (elapsed_ns / 1e9);
+    if (n == 1) {
+      base = throughput;
+    }
+    printf("Threads = %2d, Execution Time = %f seconds, Throughput = %.0f ops/sec, Speedup = %.2f\n",
+           n,
+           elapsed_ns / 1e9,
+           throughput,
+           throughput / base);
+
+    if (n < max_threads && n * 2 > max_threads) {
+      //always finish with max_threads
+      n = max_threads / 2;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,36 @@
+/*
+Allocation traces: the stream of malloc/free/realloc calls of a real
+program, recorded by libtrace_record.so and replayed by trace_replay.
+
+A trace file is TRACE_MAGIC followed by one record per call:
+
+    | op (1 byte) | id (varint) | arguments (varints) |
+
+    TRACE_MALLOC   id size         id = malloc(size)
+    TRACE_CALLOC   id size         id = calloc(1, size), size is the total
+    TRACE_MEMALIGN id align size   id = memalign(align, size)
+    TRACE_REALLOC  id size         id = realloc(id, size), same id after
+    TRACE_FREE     id              free(id)
+
+A varint is 7 bits per byte, lowest bits first, the high bit set on all
+but the last byte. An id names a live block: the recorder reuses the id
+of a freed block before it makes a new one, so the ids of a trace stay
+below the most blocks it ever had live at once.
+realloc(NULL, size) is recorded as a malloc and realloc(p, 0) as a free.
+A block the recorder did not see allocated (one from before a fork, say)
+is not recorded, and a trace may free an id that is not live; replay
+skips such a free.
+*/
+#include <stdint.h>
+
+#define TRACE_MAGIC "MALTRC01"
+#define TRACE_MAGIC_SIZE 8
+
+#define TRACE_MALLOC 'M'
+#define TRACE_CALLOC 'C'
+#define TRACE_MEMALIGN 'A'
+#define TRACE_REALLOC 'R'
+#define TRACE_FREE 'F'
+
+//a record is never longer than this: op + 3 varints of up to 10 bytes
+#define TRACE_MAX_RECORD 31
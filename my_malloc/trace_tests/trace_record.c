@@ -0,0 +1,376 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+Allocation trace recorder: LD_PRELOAD=./libtrace_record.so program
+records every malloc/calloc/realloc/memalign/free of the program (see
+trace.h) into MYMALLOC_TRACE.<pid>, malloc.trace.<pid> by default, and
+leaves the allocation itself to glibc.
+
+The recorder itself must not allocate, so its tables are mmapped and the
+records go through a static buffer. One lock is held around every call,
+so the records of all threads are in the order the calls happened.
+*/
+
+//glibc's own entry points, they do not come back through the symbols below
+void * __libc_malloc(size_t size);
+void __libc_free(void * ptr);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * ptr, size_t size);
+void * __libc_memalign(size_t alignment, size_t size);
+
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//-1 until the first record, -2 if the file could not be opened
+int trace_fd = -1;
+//records wait here until the buffer is full or the program exits
+char trace_buf[64 * 1024];
+size_t trace_len = 0;
+
+//live blocks: an open addressing table from address to id
+typedef struct trace_slot_tag {
+  void * ptr;
+  uint64_t id;
+} trace_slot_t;
+
+trace_slot_t * trace_map = NULL;
+size_t trace_cap = 0;
+size_t trace_live = 0;
+
+//ids of freed blocks, reused before a new id is made
+uint64_t * trace_ids = NULL;
+size_t trace_ids_cap = 0;
+size_t trace_ids_top = 0;
+uint64_t trace_next_id = 0;
+
+//Return zeroed memory straight from the OS
+void * traceMap(size_t bytes) {
+  void * p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+//Write the buffered records to the trace file
+void traceFlush() {
+  size_t done = 0;
+  while (trace_fd >= 0 && done < trace_len) {
+    ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  trace_len = 0;
+}
+
+/*
+Open MYMALLOC_TRACE.<pid> and write the magic, on the first record
+(the path is put together by hand, snprintf may allocate)
+*/
+void traceOpen() {
+  const char * name = getenv("MYMALLOC_TRACE");
+  if (name == NULL) {
+    name = "malloc.trace";
+  }
+  char digits[16];
+  int n = 0;
+  for (int pid = getpid(); pid > 0; pid /= 10) {
+    digits[n++] = '0' + pid % 10;
+  }
+  char path[4096];
+  size_t len = strlen(name);
+  if (len + n + 2 > sizeof(path)) {
+    trace_fd = -2;
+    return;
+  }
+  memcpy(path, name, len);
+  path[len++] = '.';
+  while (n > 0) {
+    path[len++] = digits[--n];
+  }
+  path[len] = '\0';
+
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    trace_fd = -2;
+    return;
+  }
+  memcpy(trace_buf, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+  trace_len = TRACE_MAGIC_SIZE;
+}
+
+//Append v to the buffer as a varint
+void traceVarint(uint64_t v) {
+  while (v >= 0x80) {
+    trace_buf[trace_len++] = (char)(v | 0x80);
+    v >>= 7;
+  }
+  trace_buf[trace_len++] = (char)v;
+}
+
+//Append one record with nargs arguments
+void traceRecord(char op, uint64_t id, int nargs, uint64_t a, uint64_t b) {
+  if (trace_fd == -1) {
+    traceOpen();
+  }
+  if (trace_fd < 0) {
+    return;
+  }
+  if (trace_len + TRACE_MAX_RECORD > sizeof(trace_buf)) {
+    traceFlush();
+  }
+  trace_buf[trace_len++] = op;
+  traceVarint(id);
+  if (nargs > 0) {
+    traceVarint(a);
+  }
+  if (nargs > 1) {
+    traceVarint(b);
+  }
+}
+
+//Return the slot of ptr in the map, or the empty slot where it would go
+size_t traceSlot(void * ptr) {
+  size_t i = (((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15UL) & (trace_cap - 1);
+  while (trace_map[i].ptr != NULL && trace_map[i].ptr != ptr) {
+    i = (i + 1) & (trace_cap - 1);
+  }
+  return i;
+}
+
+//Double the map (or make the first one), return 0 if there is no memory
+int traceGrow() {
+  trace_slot_t * old = trace_map;
+  size_t old_cap = trace_cap;
+
+  size_t cap = (old_cap == 0) ? 4096 : old_cap * 2;
+  trace_slot_t * map = traceMap(cap * sizeof(trace_slot_t));
+  if (map == NULL) {
+    return 0;
+  }
+  trace_map = map;
+  trace_cap = cap;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].ptr != NULL) {
+      trace_map[traceSlot(old[i].ptr)] = old[i];
+    }
+  }
+  if (old != NULL) {
+    munmap(old, old_cap * sizeof(trace_slot_t));
+  }
+  return 1;
+}
+
+//Give the new block ptr an id and return it, or -1 if the map is full
+int64_t traceAdd(void * ptr) {
+  //keep the map at most half full
+  if ((trace_live + 1) * 2 > trace_cap && !traceGrow()) {
+    return -1;
+  }
+  uint64_t id = (trace_ids_top > 0) ? trace_ids[--trace_ids_top] : trace_next_id++;
+  size_t i = traceSlot(ptr);
+  trace_map[i].ptr = ptr;
+  trace_map[i].id = id;
+  trace_live++;
+  return id;
+}
+
+/*
+Take ptr out of the map and return its id, -1 if it is not there
+the id is not free yet, see traceRelease
+*/
+int64_t traceRemove(void * ptr) {
+  if (trace_cap == 0) {
+    return -1;
+  }
+  size_t i = traceSlot(ptr);
+  if (trace_map[i].ptr == NULL) {
+    return -1;
+  }
+  uint64_t id = trace_map[i].id;
+  trace_live--;
+
+  //backward shift: move up every later slot of the run that may have
+  //been pushed past i, so no search stops early at the hole
+  size_t hole = i;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & (trace_cap - 1);
+    if (trace_map[j].ptr == NULL) {
+      break;
+    }
+    size_t home = (((uintptr_t)trace_map[j].ptr >> 4) * 0x9E3779B97F4A7C15UL) & (trace_cap - 1);
+    //j may move to the hole if its home is not in (hole, j]
+    if (((j - home) & (trace_cap - 1)) >= ((j - hole) & (trace_cap - 1))) {
+      trace_map[hole] = trace_map[j];
+      hole = j;
+    }
+  }
+  trace_map[hole].ptr = NULL;
+  return id;
+}
+
+//Put id back for the next block
+void traceRelease(uint64_t id) {
+  if (trace_ids_top == trace_ids_cap) {
+    size_t cap = (trace_ids_cap == 0) ? 4096 : trace_ids_cap * 2;
+    uint64_t * ids = traceMap(cap * sizeof(uint64_t));
+    if (ids == NULL) {
+      //the id is lost, the trace just uses a new one later
+      return;
+    }
+    if (trace_ids != NULL) {
+      memcpy(ids, trace_ids, trace_ids_top * sizeof(uint64_t));
+      munmap(trace_ids, trace_ids_cap * sizeof(uint64_t));
+    }
+    trace_ids = ids;
+    trace_ids_cap = cap;
+  }
+  trace_ids[trace_ids_top++] = id;
+}
+
+//Record the new block ptr made by op
+void traceNew(char op, void * ptr, int nargs, uint64_t a, uint64_t b) {
+  if (ptr == NULL) {
+    return;
+  }
+  int64_t id = traceAdd(ptr);
+  if (id >= 0) {
+    traceRecord(op, id, nargs, a, b);
+  }
+}
+
+//Record a free of ptr
+void traceFree(void * ptr) {
+  int64_t id = traceRemove(ptr);
+  if (id >= 0) {
+    traceRecord(TRACE_FREE, id, 0, 0, 0);
+    traceRelease(id);
+  }
+}
+
+void * malloc(size_t size) {
+  pthread_mutex_lock(&trace_lock);
+  void * ptr = __libc_malloc(size);
+  traceNew(TRACE_MALLOC, ptr, 1, size, 0);
+  pthread_mutex_unlock(&trace_lock);
+  return ptr;
+}
+
+void * calloc(size_t count, size_t size) {
+  pthread_mutex_lock(&trace_lock);
+  void * ptr = __libc_calloc(count, size);
+  traceNew(TRACE_CALLOC, ptr, 1, count * size, 0);
+  pthread_mutex_unlock(&trace_lock);
+  return ptr;
+}
+
+void * memalign(size_t alignment, size_t size) {
+  pthread_mutex_lock(&trace_lock);
+  void * ptr = __libc_memalign(alignment, size);
+  traceNew(TRACE_MEMALIGN, ptr, 2, alignment, size);
+  pthread_mutex_unlock(&trace_lock);
+  return ptr;
+}
+
+void * aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+    return EINVAL;
+  }
+  void * ptr = memalign(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void * valloc(size_t size) {
+  return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void * pvalloc(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+void * realloc(void * ptr, size_t size) {
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  void * new_ptr = __libc_realloc(ptr, size);
+  if (new_ptr != NULL) {
+    //the block keeps its id
+    int64_t id = traceRemove(ptr);
+    if (id >= 0) {
+      size_t i = traceSlot(new_ptr);
+      trace_map[i].ptr = new_ptr;
+      trace_map[i].id = id;
+      trace_live++;
+      traceRecord(TRACE_REALLOC, id, 1, size, 0);
+    }
+    else {
+      traceNew(TRACE_MALLOC, new_ptr, 1, size, 0);
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return new_ptr;
+}
+
+void free(void * ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&trace_lock);
+  __libc_free(ptr);
+  traceFree(ptr);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+A forked child gets a trace of its own: the records buffered so far are
+the parent's, and the child's blocks from before the fork are not in
+its trace
+*/
+void tracePrefork() {
+  pthread_mutex_lock(&trace_lock);
+}
+
+void traceParent() {
+  pthread_mutex_unlock(&trace_lock);
+}
+
+void traceChild() {
+  if (trace_fd >= 0) {
+    close(trace_fd);
+  }
+  trace_fd = -1;
+  trace_len = 0;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((constructor)) void traceStart() {
+  pthread_atfork(tracePrefork, traceParent, traceChild);
+}
+
+__attribute__((destructor)) void traceStop() {
+  pthread_mutex_lock(&trace_lock);
+  traceFlush();
+  pthread_mutex_unlock(&trace_lock);
+}
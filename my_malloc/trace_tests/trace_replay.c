@@ -0,0 +1,296 @@
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "my_malloc.h"
+#include "trace.h"
+
+//heap samples printed over the run
+#define NUM_SAMPLES 20
+//the heap is measured every SAMPLE_EVENTS events, for the peak
+#define SAMPLE_EVENTS 256
+
+#ifdef FF
+#define MALLOC(sz) ff_malloc(sz)
+#define FREE(p) ff_free(p)
+#define REALLOC(p, sz) ff_realloc(p, sz)
+#define MEMALIGN(al, sz) ff_memalign(al, sz)
+#endif
+#ifdef BF
+#define MALLOC(sz) bf_malloc(sz)
+#define FREE(p) bf_free(p)
+#define REALLOC(p, sz) bf_realloc(p, sz)
+#define MEMALIGN(al, sz) bf_memalign(al, sz)
+#endif
+#ifdef LIBC
+#define MALLOC(sz) malloc(sz)
+#define FREE(p) free(p)
+#define REALLOC(p, sz) realloc(p, sz)
+#define MEMALIGN(al, sz) memalign(al, sz)
+#endif
+
+typedef struct event_tag {
+  char op;
+  uint64_t id;
+  size_t size;
+  size_t alignment;
+} event_t;
+
+double calc_time(struct timespec start, struct timespec end) {
+  double start_sec = (double)start.tv_sec * 1000000000.0 + (double)start.tv_nsec;
+  double end_sec = (double)end.tv_sec * 1000000000.0 + (double)end.tv_nsec;
+
+  if (end_sec < start_sec) {
+    return 0;
+  }
+  else {
+    return end_sec - start_sec;
+  }
+};
+
+/*
+The memory of the driver itself comes from mmap, so that it is not in
+the heap that is measured
+*/
+void * map_memory(size_t bytes) {
+  void * p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/*
+Heap size and free space in bytes: for our allocator the data segment,
+for glibc its main arena (mallinfo2), both with the mapped large blocks
+*/
+void heap_usage(unsigned long * size, unsigned long * free_space) {
+#ifdef LIBC
+  struct mallinfo2 info = mallinfo2();
+  *size = info.arena + info.hblkhd;
+  *free_space = info.fordblks;
+#else
+  *size = get_data_segment_size() + get_mmapped_size();
+  *free_space = get_data_segment_free_space_size();
+#endif
+}
+
+//Read a varint at *pos, return 0 if the trace ends inside it
+int read_varint(const unsigned char * data, size_t length, size_t * pos, uint64_t * value) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64 && *pos < length; shift += 7) {
+    unsigned char byte = data[(*pos)++];
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *value = v;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+Decode the whole trace before the clock starts
+return the number of events, *max_id is the largest id + 1
+*/
+size_t load_trace(const char * path, event_t ** out, uint64_t * max_id) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  size_t length = st.st_size;
+  if (length < TRACE_MAGIC_SIZE) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    exit(EXIT_FAILURE);
+  }
+  const unsigned char * data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  //a record is at least 2 bytes
+  event_t * events = map_memory((length / 2 + 1) * sizeof(event_t));
+  size_t count = 0;
+  size_t pos = TRACE_MAGIC_SIZE;
+  *max_id = 0;
+  while (pos < length) {
+    event_t * e = &events[count];
+    e->op = data[pos++];
+    e->size = 0;
+    e->alignment = 0;
+    int ok = read_varint(data, length, &pos, &e->id);
+    if (ok && (e->op == TRACE_MALLOC || e->op == TRACE_CALLOC || e->op == TRACE_REALLOC)) {
+      ok = read_varint(data, length, &pos, &e->size);
+    }
+    else if (ok && e->op == TRACE_MEMALIGN) {
+      ok = read_varint(data, length, &pos, &e->alignment) && read_varint(data, length, &pos, &e->size);
+    }
+    else if (ok && e->op != TRACE_FREE) {
+      fprintf(stderr, "%s: bad record at byte %zu\n", path, pos);
+      exit(EXIT_FAILURE);
+    }
+    if (!ok) {
+      //a trace cut short by a crash still replays up to there
+      break;
+    }
+    if (e->id >= *max_id) {
+      *max_id = e->id + 1;
+    }
+    count++;
+  }
+
+  munmap((void *)data, length);
+  close(fd);
+  *out = events;
+  return count;
+}
+
+int cmp_latency(const void * a, const void * b) {
+  unsigned x = *(const unsigned *)a;
+  unsigned y = *(const unsigned *)b;
+  return (x > y) - (x < y);
+}
+
+//Sort the latencies and print their percentiles
+void print_latency(const char * name, unsigned * ns, size_t count) {
+  if (count == 0) {
+    printf("%-7s no calls\n", name);
+    return;
+  }
+  qsort(ns, count, sizeof(unsigned), cmp_latency);
+  printf("%-7s %zu calls, p50 = %u ns, p99 = %u ns, p99.9 = %u ns, max = %u ns\n",
+         name,
+         count,
+         ns[count / 2],
+         ns[(size_t)(count * 0.99)],
+         ns[(size_t)(count * 0.999)],
+         ns[count - 1]);
+}
+
+/*
+Replay a trace recorded by libtrace_record.so: every event is timed on
+its own, and the heap is measured every SAMPLE_EVENTS events.
+*/
+int main(int argc, char * argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s trace\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  event_t * events;
+  uint64_t max_id;
+  size_t count = load_trace(argv[1], &events, &max_id);
+
+  char ** blocks = map_memory((max_id + 1) * sizeof(char *));
+  unsigned * alloc_ns = map_memory((count + 1) * sizeof(unsigned));
+  unsigned * free_ns = map_memory((count + 1) * sizeof(unsigned));
+  size_t allocs = 0;
+  size_t frees = 0;
+  unsigned long peak = 0;
+  size_t sample_every = (count / NUM_SAMPLES > 0) ? count / NUM_SAMPLES : 1;
+
+  struct timespec start_time, end_time, t0, t1;
+  unsigned long size, free_space;
+  //time spent measuring the heap, which is not part of the replay
+  double sample_ns = 0;
+
+  //Start Time
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  for (size_t i = 0; i < count; i++) {
+    event_t * e = &events[i];
+    char ** block = &blocks[e->id];
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    switch (e->op) {
+      case TRACE_MALLOC:
+        *block = MALLOC(e->size);
+        break;
+      case TRACE_CALLOC:
+        *block = MALLOC(e->size);
+        if (*block != NULL) {
+          memset(*block, 0, e->size);
+        }
+        break;
+      case TRACE_MEMALIGN:
+        *block = MEMALIGN(e->alignment, e->size);
+        break;
+      case TRACE_REALLOC:
+        if (*block == NULL) {
+          *block = MALLOC(e->size);
+        }
+        else {
+          //a failed realloc leaves the old block allocated, size 0 frees it
+          char * p = REALLOC(*block, e->size);
+          if (p != NULL || e->size == 0) {
+            *block = p;
+          }
+        }
+        break;
+      case TRACE_FREE:
+        //a block from before the trace started has nothing to free
+        if (*block != NULL) {
+          FREE(*block);
+          *block = NULL;
+        }
+        break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    unsigned ns = (unsigned)calc_time(t0, t1);
+    if (e->op == TRACE_FREE) {
+      free_ns[frees++] = ns;
+    }
+    else {
+      alloc_ns[allocs++] = ns;
+      if (*block != NULL && e->size > 0) {
+        //touch the block, like the program did
+        (*block)[0] = (char)i;
+      }
+    }
+
+    if (i % SAMPLE_EVENTS == 0 || i % sample_every == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      heap_usage(&size, &free_space);
+      if (size > peak) {
+        peak = size;
+      }
+      if (i % sample_every == 0) {
+        printf("Event %zu: heap = %lu, free = %lu, Fragmentation = %f\n",
+               i,
+               size,
+               free_space,
+               size ? (float)free_space / (float)size : 0);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      sample_ns += calc_time(t0, t1);
+    }
+  }
+
+  //Stop Time
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+  heap_usage(&size, &free_space);
+  if (size > peak) {
+    peak = size;
+  }
+
+  double elapsed_ns = calc_time(start_time, end_time) - sample_ns;
+  printf("Events = %zu, Execution Time = %f seconds\n", count, elapsed_ns / 1e9);
+  printf("Peak Heap = %lu bytes\n", peak);
+  printf("Fragmentation  = %f\n", size ? (float)free_space / (float)size : 0);
+  print_latency("malloc:", alloc_ns, allocs);
+  print_latency("free:", free_ns, frees);
+
+  return 0;
+}